@@ -0,0 +1,149 @@
+// Admission control: per-client token buckets and a cap on queued work,
+// checked before a request is handed to the workers.
+//
+// Buckets live in fixed tables of lock-free slots. A slot is a key and one
+// 64-bit word packing the refill time and the token count, so taking a
+// token is a single compare-and-swap and the table never takes a lock or
+// allocates. Slots are claimed on first use and reclaimed from clients that
+// have been idle long enough for their bucket to refill. When every slot a
+// new client may use is busy, the one idle longest is evicted, so a crowded
+// table never lets anyone through unlimited.
+
+#ifndef ADMISSION_H
+#define ADMISSION_H
+
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <cstdlib>
+#include <string>
+
+#include "metrics.h"
+
+const int RATE_TABLE_SLOTS = 1 << 16;  // per table, a power of two
+const int RATE_TABLE_PROBES = 8;       // slots a key may live in
+const uint64_t TOKEN_SCALE = 1024;     // token fractions kept per token
+const int MAX_RATE_BURST = 16000;      // tokens fit in 24 bits at TOKEN_SCALE
+const int MAX_RATE_PER_SECOND = 1000000;
+const uint64_t MAX_REFILL_MS = 1 << 24;  // keeps the refill product well inside 64 bits
+
+struct RateLimit {
+    int perSecond = 0;  // 0 disables the limit
+    int burst = 0;
+};
+
+inline RateLimit ipRateLimit = { 1000, 2000 };
+inline RateLimit sessionRateLimit = { 100, 200 };
+inline int maxPendingRequests = 1024;  // requests waiting for or running in a worker
+
+inline uint64_t admissionClockMs() {
+    static const auto start = std::chrono::steady_clock::now();
+    return std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now() - start).count();
+}
+
+class TokenBucketTable {
+public:
+    // Takes a token for key (never 0). Returns 0 if the request may go
+    // ahead, otherwise the seconds until the bucket has a token again.
+    int take(uint64_t key, const RateLimit& limit) {
+        if (limit.perSecond <= 0) return 0;
+        uint64_t now = admissionClockMs();
+        uint64_t full = (uint64_t)limit.burst * TOKEN_SCALE;
+        uint64_t refillMs = full / ((uint64_t)limit.perSecond * TOKEN_SCALE) * 1000 + 1000;
+
+        Slot* slot = find(key, now, refillMs, full);
+        if (!slot) return 1;  // lost a race for a crowded window: fail closed, the client retries
+
+        uint64_t state = slot->state.load(std::memory_order_relaxed);
+        while (true) {
+            uint64_t tokens = refill(state, now, limit, full);
+            if (tokens < TOKEN_SCALE) {
+                uint64_t missing = TOKEN_SCALE - tokens;
+                uint64_t perSecond = (uint64_t)limit.perSecond * TOKEN_SCALE;
+                return (int)((missing + perSecond - 1) / perSecond);
+            }
+            if (slot->state.compare_exchange_weak(state, pack(now, tokens - TOKEN_SCALE), std::memory_order_relaxed))
+                return 0;
+        }
+    }
+
+private:
+    struct alignas(16) Slot {
+        std::atomic<uint64_t> key{0};    // 0 while free
+        std::atomic<uint64_t> state{0};  // refill time in ms << 24 | tokens
+    };
+
+    static uint64_t pack(uint64_t timeMs, uint64_t tokens) { return timeMs << 24 | tokens; }
+    static uint64_t timeOf(uint64_t state) { return state >> 24; }
+    static uint64_t tokensOf(uint64_t state) { return state & ((1 << 24) - 1); }
+
+    static uint64_t refill(uint64_t state, uint64_t now, const RateLimit& limit, uint64_t full) {
+        uint64_t elapsed = now > timeOf(state) ? now - timeOf(state) : 0;
+        if (elapsed > MAX_REFILL_MS) elapsed = MAX_REFILL_MS;
+        uint64_t tokens = tokensOf(state) + elapsed * limit.perSecond * TOKEN_SCALE / 1000;
+        return tokens < full ? tokens : full;
+    }
+
+    // The key's slot, claiming a free one or one whose owner has been idle
+    // for refillMs (its bucket would be full again, so nothing is lost).
+    // With neither in reach, the slot idle longest is evicted; null only
+    // when another thread takes that slot first.
+    Slot* find(uint64_t key, uint64_t now, uint64_t refillMs, uint64_t full) {
+        size_t start = (size_t)((key * 0x9e3779b97f4a7c15ULL) >> 48) & (RATE_TABLE_SLOTS - 1);
+        Slot* oldest = nullptr;
+        uint64_t oldestOwner = 0, oldestTime = UINT64_MAX;
+        for (int probe = 0; probe < RATE_TABLE_PROBES; probe++) {
+            Slot& slot = slots[(start + probe) & (RATE_TABLE_SLOTS - 1)];
+            uint64_t owner = slot.key.load(std::memory_order_acquire);
+            if (owner == key) return &slot;
+
+            uint64_t state = slot.state.load(std::memory_order_relaxed);
+            bool reclaimable = owner == 0 || (now > timeOf(state) && now - timeOf(state) >= refillMs);
+            if (!reclaimable) {
+                if (timeOf(state) < oldestTime) {
+                    oldest = &slot;
+                    oldestOwner = owner;
+                    oldestTime = timeOf(state);
+                }
+                continue;
+            }
+            if (claim(slot, owner, key, now, full)) return &slot;
+        }
+        if (oldest && claim(*oldest, oldestOwner, key, now, full)) {
+            countMetric(RATE_LIMIT_EVICTIONS);
+            return oldest;
+        }
+        return nullptr;
+    }
+
+    // Whoever wins the key also resets the bucket; a loser whose key was
+    // installed by someone else uses the slot as it is
+    static bool claim(Slot& slot, uint64_t owner, uint64_t key, uint64_t now, uint64_t full) {
+        if (slot.key.compare_exchange_strong(owner, key, std::memory_order_acq_rel)) {
+            slot.state.store(pack(now, full), std::memory_order_relaxed);
+            return true;
+        }
+        return owner == key;
+    }
+
+    Slot slots[RATE_TABLE_SLOTS];
+};
+
+inline TokenBucketTable ipBuckets;
+inline TokenBucketTable sessionBuckets;
+
+// "N" or "N/BURST" requests per second; the burst defaults to 2N, 0 turns
+// the limit off
+inline bool parseRateLimit(const std::string& text, RateLimit& limit) {
+    char* end;
+    long perSecond = strtol(text.c_str(), &end, 10);
+    long burst = perSecond * 2;
+    if (*end == '/') burst = strtol(end + 1, &end, 10);
+    if (*end != '\0' || perSecond < 0 || burst < 0) return false;
+    if (perSecond > 0 && burst < 1) burst = 1;
+    limit.perSecond = (int)(perSecond < MAX_RATE_PER_SECOND ? perSecond : MAX_RATE_PER_SECOND);
+    limit.burst = (int)(burst < MAX_RATE_BURST ? burst : MAX_RATE_BURST);
+    return true;
+}
+
+#endif
@@ -0,0 +1,221 @@
+// Scaling benchmark for the game hot paths on generated castles.
+//
+//   g++ -std=c++17 -O2 -pthread bench.cpp -o treasure_bench
+//   ./treasure_bench [--sizes 10,1000,1000000] [--degree D] [--seed S] [--iterations N]
+//   ./treasure_bench --write-map FILE --sizes N   (save a generated castle for --map)
+//
+// For each castle size it times the work behind every endpoint and prints
+// throughput and latency percentiles.
+
+#include "game.h"
+
+#include <chrono>
+#include <iomanip>
+#include <functional>
+
+using namespace std;
+using Clock = chrono::steady_clock;
+
+struct BenchResult {
+    string name;
+    vector<double> samples;  // microseconds
+    double totalSeconds = 0;
+};
+
+double percentile(const vector<double>& sorted, double p) {
+    if (sorted.empty()) return 0;
+    size_t i = (size_t)(p * (sorted.size() - 1) + 0.5);
+    return sorted[min(i, sorted.size() - 1)];
+}
+
+// Runs op `iterations` times, calling prepare untimed before each run
+BenchResult measure(const string& name, int iterations, const function<void()>& prepare, const function<void()>& op) {
+    BenchResult result;
+    result.name = name;
+    result.samples.reserve(iterations);
+    for (int i = 0; i < iterations; i++) {
+        prepare();
+        auto start = Clock::now();
+        op();
+        double us = chrono::duration<double, micro>(Clock::now() - start).count();
+        result.samples.push_back(us);
+        result.totalSeconds += us / 1e6;
+    }
+    sort(result.samples.begin(), result.samples.end());
+    return result;
+}
+
+void printResult(const BenchResult& r) {
+    double opsPerSec = r.totalSeconds > 0 ? r.samples.size() / r.totalSeconds : 0;
+    cout << "  " << left << setw(14) << r.name << right << fixed << setprecision(1)
+         << setw(12) << opsPerSec
+         << setw(11) << percentile(r.samples, 0.50)
+         << setw(11) << percentile(r.samples, 0.90)
+         << setw(11) << percentile(r.samples, 0.99)
+         << setw(11) << percentile(r.samples, 0.999)
+         << setw(11) << r.samples.back() << endl;
+}
+
+vector<int> parseSizes(const string& list) {
+    vector<int> sizes;
+    size_t pos = 0;
+    while (pos < list.size()) {
+        size_t comma = list.find(',', pos);
+        if (comma == string::npos) comma = list.size();
+        int n = atoi(list.substr(pos, comma - pos).c_str());
+        if (n >= 4) sizes.push_back(n);
+        pos = comma + 1;
+    }
+    return sizes;
+}
+
+vector<int> randomStops(int roomCount, int count, mt19937& rng) {
+    vector<int> stops;
+    while ((int)stops.size() < count) {
+        int r = rng() % roomCount;
+        if (r != castle.entrance && find(stops.begin(), stops.end(), r) == stops.end()) stops.push_back(r);
+    }
+    return stops;
+}
+
+// Games never have more than MAX_TREASURES stops, so the 2-opt heuristic
+// behind longer tours is exercised here: checked against Held-Karp on
+// tours both can solve, then timed on longer ones. Every stop needs its
+// own route table, so big castles are skipped.
+void benchTours(int roomCount, mt19937& rng) {
+    const int TOUR_SETS = 50;
+    if (roomCount < 4 * HELD_KARP_MAX_STOPS || roomCount > 100000) return;
+
+    vector<int> dist;
+    int optimal = 0;
+    double excess = 0, worst = 0;
+    for (int s = 0; s < TOUR_SETS; s++) {
+        vector<int> stops = randomStops(roomCount, 12, rng);
+        if (!tourDistances(castle.entrance, stops, dist)) continue;
+        int exact = planTourExact(stops, dist).moves;
+        int heuristic = planTourHeuristic(stops, dist).moves;
+        if (heuristic == exact) optimal++;
+        double over = exact > 0 ? (double)(heuristic - exact) / exact : 0;
+        excess += over;
+        worst = max(worst, over);
+    }
+    cout << "  2-opt vs Held-Karp, 12 stops: optimal in " << optimal << "/" << TOUR_SETS
+         << ", " << setprecision(1) << 100 * excess / TOUR_SETS << "% longer on average, "
+         << 100 * worst << "% at worst" << endl;
+
+    for (int count : { 12, 32, 64 }) {
+        vector<int> stops;
+        printResult(measure("tour " + to_string(count), TOUR_SETS, [&] {
+            stops = randomStops(roomCount, count, rng);
+            tourDistances(castle.entrance, stops, dist);
+        }, [&] { planTourFromDistances(stops, dist); }));
+    }
+}
+
+void benchCastle(int roomCount, double degree, uint32_t seed, int baseIterations) {
+    auto setupStart = Clock::now();
+    CastleBuilder builder;
+    generateCastle(builder, roomCount, degree, seed);
+    CastleGraph graph;
+    string error;
+    if (!builder.build(graph, error)) {
+        cerr << "Cannot build castle: " << error << endl;
+        return;
+    }
+    installGameMap(move(graph));
+    double setupMs = chrono::duration<double, milli>(Clock::now() - setupStart).count();
+
+    // Big maps get fewer iterations so every size finishes in reasonable time
+    int iterations = (int)max<long long>(20, min<long long>(baseIterations, (long long)baseIterations * 1000 / roomCount));
+
+    cout << "\n" << roomCount << " rooms, " << castle.offsets[roomCount] / 2 << " paths, setup "
+         << fixed << setprecision(1) << setupMs << " ms, " << iterations << " iterations" << endl;
+    cout << "  " << left << setw(14) << "operation" << right << setw(12) << "ops/s"
+         << setw(11) << "p50 us" << setw(11) << "p90 us" << setw(11) << "p99 us"
+         << setw(11) << "p999 us" << setw(11) << "max us" << endl;
+
+    mt19937 rng(seed);
+    GameSession session;
+    memset(session.token, '0', SESSION_TOKEN_LENGTH);
+    resetGame(session);
+
+    printResult(measure("reset", iterations, [] {}, [&] { resetGame(session); }));
+
+    printResult(measure("state", iterations, [&] { session.version++; }, [&] { getGameState(session); }));
+    printResult(measure("state cached", iterations, [] {}, [&] { getGameState(session); }));
+
+    int target = 0;
+    printResult(measure("move", iterations, [&] {
+        session.moves = 0;
+        session.collected = 0;
+        int degree = castle.degree(session.currentRoom);
+        target = castle.begin(session.currentRoom)[rng() % degree];
+    }, [&] { movePlayer(session, target); }));
+
+    printResult(measure("hint", iterations, [&] { session.hintUsed = false; }, [&] { getHint(session); }));
+
+    int from = 0, to = 0;
+    printResult(measure("path", iterations, [&] {
+        from = rng() % roomCount;
+        to = rng() % roomCount;
+    }, [&] { findShortestPath(from, to); }));
+
+    printResult(measure("route", iterations, [] {}, [&] {
+        planTour(castle.entrance, treasureRooms(session, true));
+    }));
+
+    printResult(measure("room lookup", iterations, [&] {
+        from = rng() % roomCount;
+    }, [&] { getRoomIndex(castle.name(from)); }));
+
+    benchTours(roomCount, rng);
+}
+
+int main(int argc, char* argv[]) {
+    vector<int> sizes = { 10, 100, 1000, 10000, 100000, 1000000 };
+    double degree = 3;
+    uint32_t seed = 1;
+    int iterations = 2000;
+    string writeMap;
+
+    for (int i = 1; i < argc; i++) {
+        string arg = argv[i];
+        if (arg == "--sizes" && i + 1 < argc) {
+            sizes = parseSizes(argv[++i]);
+        } else if (arg == "--degree" && i + 1 < argc) {
+            degree = atof(argv[++i]);
+        } else if (arg == "--seed" && i + 1 < argc) {
+            seed = (uint32_t)strtoul(argv[++i], nullptr, 10);
+        } else if (arg == "--iterations" && i + 1 < argc) {
+            iterations = max(1, atoi(argv[++i]));
+        } else if (arg == "--write-map" && i + 1 < argc) {
+            writeMap = argv[++i];
+        } else {
+            cerr << "Usage: " << argv[0] << " [--sizes N,N,...] [--degree D] [--seed S] [--iterations N]" << endl;
+            cerr << "       " << argv[0] << " --write-map FILE --sizes N [--degree D] [--seed S]" << endl;
+            return 1;
+        }
+    }
+    if (sizes.empty()) {
+        cerr << "Castle sizes must be at least 4 rooms" << endl;
+        return 1;
+    }
+
+    if (!writeMap.empty()) {
+        CastleBuilder builder;
+        generateCastle(builder, sizes[0], degree, seed);
+        vector<char> image = builder.compile();
+        ofstream out(writeMap, ios::binary | ios::trunc);
+        out.write(image.data(), image.size());
+        if (!out) {
+            cerr << "Cannot write " << writeMap << endl;
+            return 1;
+        }
+        cout << "Wrote " << sizes[0] << "-room castle to " << writeMap << endl;
+        return 0;
+    }
+
+    cout << "Castle benchmark: degree " << degree << ", seed " << seed << endl;
+    for (int n : sizes) benchCastle(n, degree, seed, iterations);
+    return 0;
+}
@@ -0,0 +1,988 @@
+// Castle map shared by the server and the console game: room graph, room
+// names and hints, map file loading and shortest-path routing.
+//
+// Maps are authored as text:
+//
+//     # comment
+//     room Entrance
+//     room Armory The treasure lies where weapons rest in silence.
+//     path Entrance Hall
+//     start Entrance
+//
+// Room names are single words; anything after the name is the room's hint.
+// `start` picks the room players begin in (default: the first room).
+//
+// Text maps are compiled into a flat binary image holding the CSR graph, the
+// name/hint tables and a prebuilt hash index. The same image can be written
+// to disk and memory-mapped later, so a compiled map is used in place
+// without parsing and its pages are shared between server processes.
+
+#ifndef CASTLE_H
+#define CASTLE_H
+
+#include <string>
+#include <string_view>
+#include <vector>
+#include <deque>
+#include <memory>
+#include <atomic>
+#include <mutex>
+#include <cstdint>
+#include <cstring>
+#include <cctype>
+#include <fstream>
+#include <sstream>
+#include <algorithm>
+#include <unordered_map>
+#include <random>
+
+#include "metrics.h"
+
+#ifdef _WIN32
+    #include <windows.h>
+#else
+    #include <sys/mman.h>
+    #include <sys/stat.h>
+    #include <fcntl.h>
+    #include <unistd.h>
+#endif
+
+const int BITSET_MAX_ROOMS = 1024;         // maps up to this size keep adjacency bitmasks
+const int PRECOMPUTED_ROUTE_ROOMS = 1024;  // maps up to this size cache every route table
+const int LOCAL_ROUTE_TABLES = 2;          // recent tables each thread keeps for itself on larger maps
+const int HELD_KARP_MAX_STOPS = 16;        // tours with more stops use a heuristic
+
+const uint32_t CASTLE_MAGIC = 0x4c545343;  // "CSTL" little-endian
+const uint32_t CASTLE_FORMAT_VERSION = 1;
+
+// Compiled map layout: this header, then the int32 arrays
+//   offsets[roomCount + 1], neighbors[neighborCount],
+//   nameOffsets[roomCount + 1], hintOffsets[roomCount + 1], slots[slotCount]
+// and finally the name and hint character data.
+struct CastleFileHeader {
+    uint32_t magic;
+    uint32_t version;
+    uint32_t roomCount;
+    uint32_t neighborCount;
+    uint32_t slotCount;
+    uint32_t nameBytes;
+    uint32_t hintBytes;
+    uint32_t entrance;
+};
+
+const char* const DEFAULT_CASTLE_MAP =
+    "room Entrance\n"
+    "room Hall The treasure lies where footsteps echo endlessly.\n"
+    "room Armory The treasure lies where weapons rest in silence.\n"
+    "room TreasureRoom The treasure lies where riches are locked away.\n"
+    "room Library The treasure lies where knowledge rests and dust gathers.\n"
+    "room Kitchen The treasure lies where food fills the air with warmth.\n"
+    "room Dungeon The treasure lies deep underground, cold and dark.\n"
+    "room Observatory The treasure lies where stars are watched at night.\n"
+    "room Garden The treasure lies where flowers bloom and secrets grow.\n"
+    "room Balcony The treasure lies where winds whisper tales.\n"
+    "path Entrance Hall\n"
+    "path Entrance Library\n"
+    "path Hall Armory\n"
+    "path Hall Library\n"
+    "path Hall Dungeon\n"
+    "path Library Kitchen\n"
+    "path Library Armory\n"
+    "path Library Observatory\n"
+    "path Armory TreasureRoom\n"
+    "path Kitchen TreasureRoom\n"
+    "path Kitchen Dungeon\n"
+    "path Kitchen Garden\n"
+    "path Observatory Balcony\n"
+    "path Garden Balcony\n"
+    "start Entrance\n";
+
+// FNV-1a. Part of the compiled format, so it must not change.
+inline uint32_t hashRoomName(std::string_view name) {
+    uint32_t h = 2166136261u;
+    for (char c : name) {
+        h ^= (unsigned char)c;
+        h *= 16777619u;
+    }
+    return h;
+}
+
+// Castle map in compressed sparse row form: the neighbours of room r are
+// neighbors[offsets[r]] .. neighbors[offsets[r + 1] - 1], sorted by index.
+// The arrays point into a compiled map image, either built in memory or
+// mapped from a file. Small maps also keep a bitmask row per room for O(1)
+// connection tests.
+struct CastleGraph {
+    int roomCount = 0;
+    int entrance = 0;
+    const int32_t* offsets = nullptr;
+    const int32_t* neighbors = nullptr;
+    const int32_t* nameOffsets = nullptr;
+    const int32_t* hintOffsets = nullptr;
+    const int32_t* slots = nullptr;  // open-addressing name index, -1 = empty
+    uint32_t slotCount = 0;
+    const char* names = nullptr;
+    const char* hints = nullptr;
+    int bitWords = 0;  // 64-bit words per bitmask row, 0 if no bitmasks
+    std::vector<uint64_t> adjBits;
+    std::shared_ptr<const void> backing;  // keeps the image alive
+
+    const int* begin(int room) const { return neighbors + offsets[room]; }
+    const int* end(int room) const { return neighbors + offsets[room + 1]; }
+    int degree(int room) const { return offsets[room + 1] - offsets[room]; }
+
+    bool connected(int a, int b) const {
+        if (bitWords) return (adjBits[(size_t)a * bitWords + b / 64] >> (b % 64)) & 1;
+        return std::binary_search(begin(a), end(a), b);
+    }
+
+    std::string_view name(int room) const {
+        return std::string_view(names + nameOffsets[room], nameOffsets[room + 1] - nameOffsets[room]);
+    }
+
+    std::string_view hint(int room) const {
+        return std::string_view(hints + hintOffsets[room], hintOffsets[room + 1] - hintOffsets[room]);
+    }
+
+    int find(std::string_view roomName) const {
+        if (slotCount == 0) return -1;
+        uint32_t mask = slotCount - 1;
+        for (uint32_t i = hashRoomName(roomName) & mask; slots[i] != -1; i = (i + 1) & mask)
+            if (name(slots[i]) == roomName) return slots[i];
+        return -1;
+    }
+
+    // Offsets that start at 0, never decrease and end at total
+    static bool validOffsets(const int32_t* offsets, uint32_t count, uint32_t total) {
+        if (offsets[0] != 0 || (uint32_t)offsets[count] != total) return false;
+        for (uint32_t i = 0; i < count; i++)
+            if (offsets[i] > offsets[i + 1]) return false;
+        return true;
+    }
+
+    // Points the graph at a compiled image. Every offset, neighbour and
+    // index slot is checked in one pass first, so a truncated or corrupt
+    // file is rejected instead of read out of bounds.
+    bool attach(std::shared_ptr<const void> owner, const char* data, size_t size, std::string& error) {
+        CastleFileHeader h;
+        if (size < sizeof(h)) {
+            error = "file too short";
+            return false;
+        }
+        memcpy(&h, data, sizeof(h));
+        if (h.magic != CASTLE_MAGIC || h.version != CASTLE_FORMAT_VERSION) {
+            error = "not a compiled castle map of this version";
+            return false;
+        }
+        uint64_t ints = (uint64_t)h.roomCount * 3 + 3 + h.neighborCount + h.slotCount;
+        if (sizeof(h) + ints * 4 + (uint64_t)h.nameBytes + h.hintBytes != size || h.entrance >= h.roomCount
+            || h.roomCount >= (uint32_t)INT32_MAX || h.neighborCount >= (uint32_t)INT32_MAX
+            || (h.slotCount & (h.slotCount - 1)) != 0 || h.slotCount <= h.roomCount) {
+            error = "corrupt castle map";
+            return false;
+        }
+
+        const int32_t* p = (const int32_t*)(data + sizeof(h));
+        const int32_t* offsetArray = p;
+        p += h.roomCount + 1;
+        const int32_t* neighborArray = p;
+        p += h.neighborCount;
+        const int32_t* nameArray = p;
+        p += h.roomCount + 1;
+        const int32_t* hintArray = p;
+        p += h.roomCount + 1;
+        const int32_t* slotArray = p;
+        p += h.slotCount;
+
+        // Rows must be sorted without repeats for binary_search, and the
+        // name index needs a free slot to end every probe
+        bool valid = validOffsets(offsetArray, h.roomCount, h.neighborCount)
+                     && validOffsets(nameArray, h.roomCount, h.nameBytes)
+                     && validOffsets(hintArray, h.roomCount, h.hintBytes);
+        for (uint32_t r = 0; valid && r < h.roomCount; r++) {
+            for (int32_t i = offsetArray[r]; i < offsetArray[r + 1]; i++) {
+                int32_t n = neighborArray[i];
+                if (n < 0 || (uint32_t)n >= h.roomCount || (i > offsetArray[r] && n <= neighborArray[i - 1])) {
+                    valid = false;
+                    break;
+                }
+            }
+        }
+        uint32_t freeSlots = 0;
+        for (uint32_t i = 0; valid && i < h.slotCount; i++) {
+            if (slotArray[i] == -1) freeSlots++;
+            else if (slotArray[i] < 0 || (uint32_t)slotArray[i] >= h.roomCount) valid = false;
+        }
+        if (!valid || freeSlots == 0) {
+            error = "corrupt castle map";
+            return false;
+        }
+
+        roomCount = (int)h.roomCount;
+        entrance = (int)h.entrance;
+        offsets = offsetArray;
+        neighbors = neighborArray;
+        nameOffsets = nameArray;
+        hintOffsets = hintArray;
+        slots = slotArray;
+        slotCount = h.slotCount;
+        names = (const char*)p;
+        hints = names + h.nameBytes;
+        backing = std::move(owner);
+
+        bitWords = 0;
+        adjBits.clear();
+        if (roomCount <= BITSET_MAX_ROOMS) {
+            bitWords = (roomCount + 63) / 64;
+            adjBits.assign((size_t)roomCount * bitWords, 0);
+            for (int r = 0; r < roomCount; r++)
+                for (const int* n = begin(r); n != end(r); n++)
+                    adjBits[(size_t)r * bitWords + *n / 64] |= 1ULL << (*n % 64);
+        }
+        return true;
+    }
+};
+
+// Rooms and paths as authored, before compilation
+struct CastleBuilder {
+    std::vector<std::string> rooms;
+    std::vector<std::string> hints;
+    std::vector<std::pair<int, int>> paths;
+    std::unordered_map<std::string, int> index;
+    int entrance = 0;
+
+    int findRoom(std::string_view name) const {
+        auto it = index.find(std::string(name));
+        return it == index.end() ? -1 : it->second;
+    }
+
+    bool addRoom(std::string_view name, std::string_view hint = std::string_view()) {
+        if (findRoom(name) != -1) return false;
+        index.emplace(std::string(name), (int)rooms.size());
+        rooms.emplace_back(name);
+        hints.emplace_back(hint);
+        return true;
+    }
+
+    bool addPath(std::string_view room1, std::string_view room2) {
+        int i = findRoom(room1);
+        int j = findRoom(room2);
+        if (i == -1 || j == -1 || i == j) return false;
+        paths.push_back({ i, j });
+        return true;
+    }
+
+    // Lays the map out in the compiled image format
+    std::vector<char> compile() const {
+        int roomCount = (int)rooms.size();
+
+        // CSR rows, sorted and without duplicate paths
+        std::vector<int32_t> offsets(roomCount + 1, 0);
+        for (auto& p : paths) {
+            offsets[p.first + 1]++;
+            offsets[p.second + 1]++;
+        }
+        for (int r = 0; r < roomCount; r++) offsets[r + 1] += offsets[r];
+        std::vector<int32_t> neighbors(offsets[roomCount]);
+        std::vector<int32_t> fill(offsets.begin(), offsets.end() - 1);
+        for (auto& p : paths) {
+            neighbors[fill[p.first]++] = p.second;
+            neighbors[fill[p.second]++] = p.first;
+        }
+        int out = 0;
+        for (int r = 0; r < roomCount; r++) {
+            int32_t* rowBegin = neighbors.data() + offsets[r];
+            int32_t* rowEnd = neighbors.data() + offsets[r + 1];
+            std::sort(rowBegin, rowEnd);
+            int32_t* rowUnique = std::unique(rowBegin, rowEnd);
+            offsets[r] = out;
+            out = (int)(std::copy(rowBegin, rowUnique, neighbors.begin() + out) - neighbors.begin());
+        }
+        offsets[roomCount] = out;
+        neighbors.resize(out);
+
+        std::string names, hintText;
+        std::vector<int32_t> nameOffsets(1, 0), hintOffsets(1, 0);
+        for (int r = 0; r < roomCount; r++) {
+            names += rooms[r];
+            hintText += hints[r];
+            nameOffsets.push_back((int32_t)names.size());
+            hintOffsets.push_back((int32_t)hintText.size());
+        }
+
+        // Name index kept at most half full so probe chains stay short
+        uint32_t slotCount = 16;
+        while (slotCount < (uint32_t)roomCount * 2) slotCount *= 2;
+        std::vector<int32_t> slots(slotCount, -1);
+        for (int r = 0; r < roomCount; r++) {
+            uint32_t i = hashRoomName(rooms[r]) & (slotCount - 1);
+            while (slots[i] != -1) i = (i + 1) & (slotCount - 1);
+            slots[i] = r;
+        }
+
+        CastleFileHeader h = { CASTLE_MAGIC, CASTLE_FORMAT_VERSION, (uint32_t)roomCount, (uint32_t)neighbors.size(),
+                               slotCount, (uint32_t)names.size(), (uint32_t)hintText.size(), (uint32_t)entrance };
+        std::vector<char> image;
+        auto append = [&image](const void* data, size_t size) {
+            image.insert(image.end(), (const char*)data, (const char*)data + size);
+        };
+        append(&h, sizeof(h));
+        append(offsets.data(), offsets.size() * 4);
+        append(neighbors.data(), neighbors.size() * 4);
+        append(nameOffsets.data(), nameOffsets.size() * 4);
+        append(hintOffsets.data(), hintOffsets.size() * 4);
+        append(slots.data(), slots.size() * 4);
+        append(names.data(), names.size());
+        append(hintText.data(), hintText.size());
+        return image;
+    }
+
+    bool build(CastleGraph& graph, std::string& error) const {
+        if (rooms.empty()) {
+            error = "map has no rooms";
+            return false;
+        }
+        auto image = std::make_shared<std::vector<char>>(compile());
+        return graph.attach(image, image->data(), image->size(), error);
+    }
+};
+
+// Random castle for testing and benchmarks: rooms Room0..Room<n-1>, a random
+// spanning tree so every room is reachable, then extra random paths until
+// rooms have about avgDegree neighbours. The same seed gives the same map.
+inline void generateCastle(CastleBuilder& builder, int roomCount, double avgDegree, uint32_t seed) {
+    std::mt19937 rng(seed);
+    for (int i = 0; i < roomCount; i++) builder.addRoom("Room" + std::to_string(i));
+    for (int i = 1; i < roomCount; i++) builder.paths.push_back({ (int)(rng() % i), i });
+
+    long long target = (long long)(roomCount * avgDegree / 2);
+    for (long long e = roomCount - 1; e < target && roomCount > 1; e++) {
+        int a = rng() % roomCount;
+        int b = rng() % roomCount;
+        if (a != b) builder.paths.push_back({ a, b });
+    }
+    builder.entrance = 0;
+}
+
+inline bool isRoomNameChar(char c) {
+    return isalnum((unsigned char)c) || c == '_' || c == '-';
+}
+
+inline bool parseCastleText(std::string_view text, CastleBuilder& builder, std::string& error) {
+    std::string startRoom;
+    int lineNumber = 0;
+    while (!text.empty()) {
+        size_t lineEnd = text.find('\n');
+        std::string_view line = text.substr(0, lineEnd);
+        text = lineEnd == std::string_view::npos ? std::string_view() : text.substr(lineEnd + 1);
+        lineNumber++;
+
+        std::istringstream words{ std::string(line) };
+        std::string keyword, first, second;
+        if (!(words >> keyword) || keyword[0] == '#') continue;
+        words >> first;
+        for (char c : first) {
+            if (!isRoomNameChar(c)) {
+                error = "line " + std::to_string(lineNumber) + ": bad room name '" + first + "'";
+                return false;
+            }
+        }
+
+        bool ok = !first.empty();
+        if (keyword == "room" && ok) {
+            std::string hint;
+            std::getline(words >> std::ws, hint);
+            while (!hint.empty() && isspace((unsigned char)hint.back())) hint.pop_back();
+            ok = builder.addRoom(first, hint);
+        } else if (keyword == "path" && ok) {
+            ok = (words >> second) && builder.addPath(first, second);
+        } else if (keyword == "start" && ok) {
+            startRoom = first;
+        } else {
+            ok = false;
+        }
+        if (!ok) {
+            error = "line " + std::to_string(lineNumber) + ": invalid '" + std::string(line) + "'";
+            return false;
+        }
+    }
+
+    if (!startRoom.empty()) {
+        builder.entrance = builder.findRoom(startRoom);
+        if (builder.entrance == -1) {
+            error = "start room '" + startRoom + "' does not exist";
+            return false;
+        }
+    }
+    return true;
+}
+
+// Maps a compiled map file read-only. Falls back to reading it into memory
+// if mapping is not possible.
+inline bool mapCastleFile(const std::string& path, CastleGraph& graph, std::string& error) {
+#ifdef _WIN32
+    HANDLE file = CreateFileA(path.c_str(), GENERIC_READ, FILE_SHARE_READ, nullptr, OPEN_EXISTING, 0, nullptr);
+    if (file != INVALID_HANDLE_VALUE) {
+        LARGE_INTEGER size;
+        HANDLE mapping = GetFileSizeEx(file, &size)
+            ? CreateFileMappingA(file, nullptr, PAGE_READONLY, 0, 0, nullptr) : nullptr;
+        CloseHandle(file);
+        if (mapping) {
+            const void* view = MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0);
+            CloseHandle(mapping);
+            if (view) {
+                std::shared_ptr<const void> owner(view, [](const void* p) { UnmapViewOfFile(p); });
+                return graph.attach(owner, (const char*)view, (size_t)size.QuadPart, error);
+            }
+        }
+    }
+#else
+    int fd = open(path.c_str(), O_RDONLY);
+    struct stat st;
+    if (fd != -1 && fstat(fd, &st) == 0 && st.st_size > 0) {
+        size_t size = (size_t)st.st_size;
+        void* view = mmap(nullptr, size, PROT_READ, MAP_SHARED, fd, 0);
+        close(fd);
+        if (view != MAP_FAILED) {
+            std::shared_ptr<const void> owner(view, [size](const void* p) { munmap((void*)p, size); });
+            return graph.attach(owner, (const char*)view, size, error);
+        }
+    } else if (fd != -1) {
+        close(fd);
+    }
+#endif
+    std::ifstream in(path, std::ios::binary);
+    auto image = std::make_shared<std::vector<char>>(std::istreambuf_iterator<char>(in), std::istreambuf_iterator<char>());
+    if (!in && !in.eof()) {
+        error = "cannot read " + path;
+        return false;
+    }
+    return graph.attach(image, image->data(), image->size(), error);
+}
+
+// Loads a text or compiled map, telling them apart by the magic number
+inline bool loadCastleFile(const std::string& path, CastleGraph& graph, std::string& error) {
+    std::ifstream in(path, std::ios::binary);
+    if (!in) {
+        error = "cannot open " + path;
+        return false;
+    }
+    uint32_t magic = 0;
+    in.read((char*)&magic, sizeof(magic));
+    if (in.gcount() == sizeof(magic) && magic == CASTLE_MAGIC) {
+        in.close();
+        return mapCastleFile(path, graph, error);
+    }
+
+    in.clear();
+    in.seekg(0);
+    std::stringstream text;
+    text << in.rdbuf();
+    CastleBuilder builder;
+    return parseCastleText(text.str(), builder, error) && builder.build(graph, error);
+}
+
+// Compiles a text map into the binary format
+inline bool compileCastleFile(const std::string& textPath, const std::string& outPath, std::string& error) {
+    std::ifstream in(textPath, std::ios::binary);
+    if (!in) {
+        error = "cannot open " + textPath;
+        return false;
+    }
+    std::stringstream text;
+    text << in.rdbuf();
+    CastleBuilder builder;
+    if (!parseCastleText(text.str(), builder, error)) return false;
+    if (builder.rooms.empty()) {
+        error = "map has no rooms";
+        return false;
+    }
+
+    std::vector<char> image = builder.compile();
+    std::ofstream out(outPath, std::ios::binary | std::ios::trunc);
+    out.write(image.data(), image.size());
+    if (!out) {
+        error = "cannot write " + outPath;
+        return false;
+    }
+    return true;
+}
+
+// The loaded castle, shared by every game
+inline CastleGraph castle;
+
+inline int getRoomIndex(std::string_view name) {
+    return castle.find(name);
+}
+
+// 64-bit FNV-1a over the room graph and entrance. Saved games are only
+// replayed on a castle with the same fingerprint.
+inline uint64_t castleFingerprint(const CastleGraph& graph) {
+    uint64_t h = 14695981039346656037ULL;
+    auto mix = [&h](uint32_t word) {
+        h ^= word;
+        h *= 1099511628211ULL;
+    };
+    mix((uint32_t)graph.roomCount);
+    mix((uint32_t)graph.entrance);
+    for (int r = 0; r <= graph.roomCount; r++) mix((uint32_t)graph.offsets[r]);
+    for (int i = 0; graph.roomCount > 0 && i < graph.offsets[graph.roomCount]; i++) mix((uint32_t)graph.neighbors[i]);
+    return h;
+}
+
+// Shortest paths towards one room, cached per target until the map changes
+struct RouteTable {
+    std::vector<int> nextHop;  // next room on the way to the target, -1 if none
+    std::vector<int> dist;     // moves needed to reach the target, -1 if unreachable
+};
+
+inline std::atomic<unsigned> castleGeneration{0};  // bumped whenever the map changes
+inline std::mutex routeLock;
+inline std::vector<std::shared_ptr<const RouteTable>> routeTables;
+inline std::deque<int> cachedRouteOrder;  // oldest first, for eviction on large maps
+inline size_t routeCacheBytes = 128u << 20;  // shared table budget on large maps; a table is 8 bytes per room
+
+inline void invalidateRoutes() {
+    std::lock_guard<std::mutex> guard(routeLock);
+    routeTables.clear();
+    cachedRouteOrder.clear();
+}
+
+// BFS from a target room. Every room's parent in the BFS tree is its next
+// step on a shortest path towards the target.
+inline std::shared_ptr<const RouteTable> buildRouteTable(int target) {
+    MetricTimer timer(TIME_ROUTE_BFS);
+    int roomCount = castle.roomCount;
+    auto table = std::make_shared<RouteTable>();
+    table->nextHop.assign(roomCount, -1);
+    table->dist.assign(roomCount, -1);
+
+    std::vector<int> q(roomCount);
+    int head = 0, tail = 0;
+    q[tail++] = target;
+    table->dist[target] = 0;
+
+    while (head < tail) {
+        int current = q[head++];
+
+        for (const int* n = castle.begin(current); n != castle.end(current); n++) {
+            if (table->dist[*n] == -1) {
+                table->dist[*n] = table->dist[current] + 1;
+                table->nextHop[*n] = current;
+                q[tail++] = *n;
+            }
+        }
+    }
+    return table;
+}
+
+// A route table a thread holds on to, tagged with the map it was built for
+struct RecentRoute {
+    unsigned generation = ~0u;
+    int target = -1;
+    std::shared_ptr<const RouteTable> table;
+};
+
+inline std::shared_ptr<const RouteTable> getRouteTable(int target) {
+    int roomCount = castle.roomCount;
+    unsigned generation = castleGeneration.load(std::memory_order_acquire);
+
+    // Small maps never evict a table, so each thread keeps its own list of
+    // the ones it has seen and stops taking the lock once it has them all.
+    // Large maps keep only the last few per thread, which is enough for
+    // repeat lookups of the entrance or a popular target to skip the lock;
+    // these stay alive outside routeCacheBytes.
+    thread_local unsigned localGeneration = ~0u;
+    thread_local std::vector<std::shared_ptr<const RouteTable>> local;
+    thread_local RecentRoute recent[LOCAL_ROUTE_TABLES];
+    bool keepLocal = roomCount <= PRECOMPUTED_ROUTE_ROOMS;
+    if (keepLocal) {
+        if (localGeneration != generation || local.size() != (size_t)roomCount) {
+            local.assign(roomCount, nullptr);
+            localGeneration = generation;
+        }
+        if (local[target]) return local[target];
+    } else {
+        for (int i = 0; i < LOCAL_ROUTE_TABLES; i++) {
+            if (recent[i].target == target && recent[i].generation == generation) {
+                std::rotate(recent, recent + i, recent + i + 1);
+                return recent[0].table;
+            }
+        }
+    }
+    auto remember = [&](const std::shared_ptr<const RouteTable>& table) {
+        if (keepLocal) {
+            local[target] = table;
+        } else {
+            std::rotate(recent, recent + LOCAL_ROUTE_TABLES - 1, recent + LOCAL_ROUTE_TABLES);
+            recent[0] = { generation, target, table };
+        }
+        return table;
+    };
+
+    {
+        std::lock_guard<std::mutex> guard(routeLock);
+        if (routeTables.size() == (size_t)roomCount && routeTables[target]) return remember(routeTables[target]);
+    }
+    std::shared_ptr<const RouteTable> table = buildRouteTable(target);
+
+    std::lock_guard<std::mutex> guard(routeLock);
+    routeTables.resize(roomCount);
+    if (routeTables[target]) return remember(routeTables[target]);
+
+    routeTables[target] = table;
+    if (roomCount > PRECOMPUTED_ROUTE_ROOMS) {
+        // Bounded by bytes, since one table on a huge map costs megabytes
+        size_t tableBytes = (size_t)roomCount * 2 * sizeof(int);
+        size_t maxTables = std::max<size_t>(1, routeCacheBytes / tableBytes);
+        cachedRouteOrder.push_back(target);
+        while (cachedRouteOrder.size() > maxTables) {
+            routeTables[cachedRouteOrder.front()].reset();
+            cachedRouteOrder.pop_front();
+        }
+    }
+    return remember(table);
+}
+
+// Builds the routing table for every room up front on maps small enough
+// to keep them all
+inline void precomputeRoutes() {
+    if (castle.roomCount > PRECOMPUTED_ROUTE_ROOMS) return;
+    for (int i = 0; i < castle.roomCount; i++) getRouteTable(i);
+}
+
+
+// Makes a freshly loaded map the current castle
+inline void installCastle(CastleGraph&& graph) {
+    castle = std::move(graph);
+    invalidateRoutes();
+    castleGeneration++;
+    precomputeRoutes();
+}
+
+// Shortest path by following precomputed next hops
+inline std::vector<int> findShortestPath(int start, int end) {
+    std::vector<int> path;
+    if (start < 0 || start >= castle.roomCount || end < 0 || end >= castle.roomCount) return path;
+
+    std::shared_ptr<const RouteTable> table = getRouteTable(end);
+    if (table->dist[start] == -1) return path;
+
+    path.reserve(table->dist[start] + 1);
+    for (int current = start; current != -1; current = table->nextHop[current]) {
+        path.push_back(current);
+    }
+    return path;
+}
+
+// Route that visits a set of rooms in the fewest moves
+struct TourPlan {
+    int moves = -1;          // -1 if some stop cannot be reached
+    std::vector<int> order;  // stops in visiting order
+    bool optimal = false;    // false when found by the heuristic
+};
+
+// Distances for the tour planners: dist[i * k + j] is the moves from stop i
+// (or the start, i == k) to stop j, -1 if unknown.
+
+// Exact shortest tour by Held-Karp DP over subsets of stops, for up to
+// HELD_KARP_MAX_STOPS stops
+inline TourPlan planTourExact(const std::vector<int>& stops, const std::vector<int>& dist) {
+    TourPlan plan;
+    int k = (int)stops.size();
+    if (k == 0) {
+        plan.moves = 0;
+        plan.optimal = true;
+        return plan;
+    }
+
+    // best[mask * k + j]: shortest walk from start covering mask, ending at j
+    const int INF = 1 << 29;
+    static thread_local std::vector<int> best;
+    static thread_local std::vector<int8_t> prev;
+    size_t states = ((size_t)1 << k) * k;
+    best.assign(states, INF);
+    prev.assign(states, -1);
+    for (int j = 0; j < k; j++)
+        if (dist[k * k + j] >= 0) best[((size_t)1 << j) * k + j] = dist[k * k + j];
+
+    for (uint32_t mask = 1; mask < (1u << k); mask++) {
+        for (int j = 0; j < k; j++) {
+            int cost = best[(size_t)mask * k + j];
+            if (cost >= INF || !(mask & (1u << j))) continue;
+            for (int n = 0; n < k; n++) {
+                if ((mask & (1u << n)) || dist[j * k + n] < 0) continue;
+                size_t next = (size_t)(mask | (1u << n)) * k + n;
+                if (cost + dist[j * k + n] < best[next]) {
+                    best[next] = cost + dist[j * k + n];
+                    prev[next] = (int8_t)j;
+                }
+            }
+        }
+    }
+
+    uint32_t mask = (1u << k) - 1;
+    int last = 0;
+    for (int j = 1; j < k; j++)
+        if (best[(size_t)mask * k + j] < best[(size_t)mask * k + last]) last = j;
+    if (best[(size_t)mask * k + last] >= INF) return plan;
+    plan.moves = best[(size_t)mask * k + last];
+    plan.optimal = true;
+    while (last != -1) {
+        plan.order.push_back(stops[last]);
+        int before = prev[(size_t)mask * k + last];
+        mask &= ~(1u << last);
+        last = before;
+    }
+    std::reverse(plan.order.begin(), plan.order.end());
+    return plan;
+}
+
+// Short tour by nearest neighbour improved by 2-opt, for any number of
+// stops. Needs every distance known.
+inline TourPlan planTourHeuristic(const std::vector<int>& stops, const std::vector<int>& dist) {
+    TourPlan plan;
+    int k = (int)stops.size();
+    if (k == 0) {
+        plan.moves = 0;
+        return plan;
+    }
+
+    // Nearest neighbour from the start...
+    std::vector<int> order;
+    std::vector<bool> used(k, false);
+    for (int from = k; (int)order.size() < k;) {
+        int pick = -1;
+        for (int j = 0; j < k; j++)
+            if (!used[j] && (pick == -1 || dist[from * k + j] < dist[from * k + pick])) pick = j;
+        used[pick] = true;
+        order.push_back(pick);
+        from = pick;
+    }
+
+    // ...then reverse segments while that shortens the walk
+    bool improved = true;
+    for (int pass = 0; improved && pass < 100; pass++) {
+        improved = false;
+        for (int i = 0; i < k - 1; i++) {
+            for (int j = i + 1; j < k; j++) {
+                int before = i == 0 ? k : order[i - 1];
+                int delta = dist[before * k + order[j]] - dist[before * k + order[i]];
+                if (j + 1 < k) delta += dist[order[i] * k + order[j + 1]] - dist[order[j] * k + order[j + 1]];
+                if (delta < 0) {
+                    std::reverse(order.begin() + i, order.begin() + j + 1);
+                    improved = true;
+                }
+            }
+        }
+    }
+
+    plan.moves = dist[k * k + order[0]];
+    for (int i = 1; i < k; i++) plan.moves += dist[order[i - 1] * k + order[i]];
+    for (int j : order) plan.order.push_back(stops[j]);
+    return plan;
+}
+
+// Shortest tour through every stop, exact when there are few enough
+inline TourPlan planTourFromDistances(const std::vector<int>& stops, const std::vector<int>& dist) {
+    return stops.size() <= (size_t)HELD_KARP_MAX_STOPS ? planTourExact(stops, dist) : planTourHeuristic(stops, dist);
+}
+
+// Fills dist for a tour from start through stops, from the cached route
+// tables, one per stop. False if some stop cannot be reached.
+inline bool tourDistances(int start, const std::vector<int>& stops, std::vector<int>& dist) {
+    int k = (int)stops.size();
+    dist.assign((k + 1) * k, -1);
+    for (int j = 0; j < k; j++) {
+        std::shared_ptr<const RouteTable> table = getRouteTable(stops[j]);
+        for (int i = 0; i < k; i++) dist[i * k + j] = table->dist[stops[i]];
+        dist[k * k + j] = table->dist[start];
+
+        // Paths are two-way, so stops reachable from the start are all
+        // reachable from each other
+        if (dist[k * k + j] < 0) return false;
+    }
+    return true;
+}
+
+// Shortest tour from start through every stop (ending anywhere)
+inline TourPlan planTour(int start, const std::vector<int>& stops) {
+    std::vector<int> dist;
+    if (!tourDistances(start, stops, dist)) return TourPlan();
+    return planTourFromDistances(stops, dist);
+}
+
+// Moves from `from` to each target, or -1 for targets more than limit moves
+// away. Only explores rooms within limit moves, so the cost depends on the
+// neighbourhood rather than the size of the map.
+inline void distancesWithin(int from, const std::vector<int>& targets, int limit, int* out) {
+    static thread_local std::vector<uint32_t> seenStamp;
+    static thread_local uint32_t stamp = 0;
+    static thread_local std::vector<int> queue, depth;
+    if (seenStamp.size() != (size_t)castle.roomCount) {
+        seenStamp.assign(castle.roomCount, 0);
+        stamp = 0;
+    }
+    if (++stamp == 0) {
+        std::fill(seenStamp.begin(), seenStamp.end(), 0);
+        stamp = 1;
+    }
+
+    size_t remaining = targets.size();
+    for (size_t t = 0; t < targets.size(); t++) {
+        out[t] = targets[t] == from ? 0 : -1;
+        if (targets[t] == from) remaining--;
+    }
+    queue.assign(1, from);
+    depth.assign(1, 0);
+    seenStamp[from] = stamp;
+    for (size_t head = 0; head < queue.size() && remaining > 0; head++) {
+        int current = queue[head];
+        if (depth[head] >= limit) continue;
+        for (const int* n = castle.begin(current); n != castle.end(current); n++) {
+            if (seenStamp[*n] == stamp) continue;
+            seenStamp[*n] = stamp;
+            queue.push_back(*n);
+            depth.push_back(depth[head] + 1);
+            for (size_t t = 0; t < targets.size(); t++) {
+                if (targets[t] == *n) {
+                    out[t] = depth[head] + 1;
+                    remaining--;
+                }
+            }
+        }
+    }
+}
+
+// Moves from every room to the nearest of a few source rooms, from one
+// multi-source BFS. Removing a source only revisits the rooms that source
+// was nearest to: they are re-seeded from their neighbours outside that
+// region and settled in distance order, so collecting a treasure costs the
+// size of its region rather than the size of the map.
+struct DistanceField {
+    static constexpr int32_t UNREACHED = INT32_MAX;
+    static constexpr uint8_t NO_SOURCE = 0xff;
+
+    unsigned generation = ~0u;  // castleGeneration the field was built for
+    std::vector<int32_t> dist;
+    std::vector<uint8_t> owner;  // index into sources of the nearest source
+    std::vector<int> sources;    // room of each source, -1 once removed
+
+    // Moves from room to the nearest source, -1 if none can be reached
+    int distance(int room) const { return dist[room] == UNREACHED ? -1 : dist[room]; }
+
+    // Sources given as -1 are left out but keep their index
+    void build(const std::vector<int>& sourceRooms) {
+        MetricTimer timer(TIME_DISTANCE_FIELD);
+        generation = castleGeneration.load();
+        dist.assign(castle.roomCount, UNREACHED);
+        owner.assign(castle.roomCount, NO_SOURCE);
+        sources = sourceRooms;
+
+        std::vector<int> queue;
+        queue.reserve(castle.roomCount);
+        for (size_t s = 0; s < sources.size(); s++) {
+            if (sources[s] < 0 || dist[sources[s]] == 0) continue;
+            dist[sources[s]] = 0;
+            owner[sources[s]] = (uint8_t)s;
+            queue.push_back(sources[s]);
+        }
+        for (size_t head = 0; head < queue.size(); head++) {
+            int current = queue[head];
+            for (const int* n = castle.begin(current); n != castle.end(current); n++) {
+                if (dist[*n] != UNREACHED) continue;
+                dist[*n] = dist[current] + 1;
+                owner[*n] = owner[current];
+                queue.push_back(*n);
+            }
+        }
+    }
+
+    void removeSource(int index) {
+        int room = sources[index];
+        if (room < 0) return;
+        MetricTimer timer(TIME_DISTANCE_FIELD);
+        sources[index] = -1;
+        if (owner[room] != index) return;  // shares its room with another source
+        if (std::all_of(sources.begin(), sources.end(), [](int s) { return s < 0; })) {
+            std::fill(dist.begin(), dist.end(), UNREACHED);
+            std::fill(owner.begin(), owner.end(), NO_SOURCE);
+            return;
+        }
+
+        // Walk the region; it is connected because every room in it was
+        // reached from a neighbour one move closer to the source. Rooms still
+        // owned by index are undiscovered, NO_SOURCE ones are in the region,
+        // so any other owner is a settled room outside it that offers a
+        // seed distance.
+        static thread_local std::vector<int> region, seedOwner, bucketStart, order;
+        region.assign(1, room);
+        seedOwner.clear();
+        owner[room] = NO_SOURCE;
+        int32_t minSeed = UNREACHED, maxSeed = 0;
+        for (size_t head = 0; head < region.size(); head++) {
+            int current = region[head];
+            int32_t best = UNREACHED;
+            int bestOwner = NO_SOURCE;
+            for (const int* n = castle.begin(current); n != castle.end(current); n++) {
+                if (owner[*n] == index) {
+                    owner[*n] = NO_SOURCE;
+                    region.push_back(*n);
+                } else if (owner[*n] != NO_SOURCE && dist[*n] + 1 < best) {
+                    best = dist[*n] + 1;
+                    bestOwner = owner[*n];
+                }
+            }
+            dist[current] = best;
+            seedOwner.push_back(bestOwner);
+            if (best != UNREACHED) {
+                minSeed = std::min(minSeed, best);
+                maxSeed = std::max(maxSeed, best);
+            }
+        }
+        for (size_t i = 0; i < region.size(); i++) owner[region[i]] = (uint8_t)seedOwner[i];
+        if (minSeed == UNREACHED) return;  // the rest of the map cannot reach it
+
+        // Seeds in distance order by counting sort
+        bucketStart.assign(maxSeed - minSeed + 2, 0);
+        for (int current : region)
+            if (dist[current] != UNREACHED) bucketStart[dist[current] - minSeed + 1]++;
+        for (size_t b = 1; b < bucketStart.size(); b++) bucketStart[b] += bucketStart[b - 1];
+        order.resize(bucketStart.back());
+        for (int current : region)
+            if (dist[current] != UNREACHED) order[bucketStart[dist[current] - minSeed]++] = current;
+
+        // Unit-weight Dijkstra: merge the sorted seeds with a FIFO whose
+        // distances never decrease. Seeds lowered since are settled through
+        // the FIFO instead and skipped here.
+        size_t nextSeed = 0, head = 0, seedCount = order.size();
+        while (nextSeed < seedCount || head < order.size() - seedCount) {
+            int current;
+            if (head == order.size() - seedCount
+                || (nextSeed < seedCount && dist[order[nextSeed]] <= dist[order[seedCount + head]])) {
+                current = order[nextSeed++];
+            } else {
+                current = order[seedCount + head++];
+            }
+            for (const int* n = castle.begin(current); n != castle.end(current); n++) {
+                if (dist[*n] <= dist[current] + 1) continue;
+                dist[*n] = dist[current] + 1;
+                owner[*n] = owner[current];
+                order.push_back(*n);
+            }
+        }
+    }
+};
+
+// Every room walked by a tour, starting with start
+inline std::vector<int> tourPath(int start, const TourPlan& plan) {
+    std::vector<int> path(1, start);
+    for (int stop : plan.order) {
+        std::vector<int> leg = findShortestPath(path.back(), stop);
+        if (leg.empty()) return std::vector<int>();
+        path.insert(path.end(), leg.begin() + 1, leg.end());
+    }
+    return path;
+}
+
+#endif
@@ -0,0 +1,593 @@
+// Game rules shared by the server and the benchmark: per-player sessions,
+// moves, hints, resets and the /api/state document.
+
+#ifndef GAME_H
+#define GAME_H
+
+#include "castle.h"
+#include "logger.h"
+
+#include <iostream>
+#include <random>
+#include <ctime>
+#include <thread>
+
+const int MAX_TREASURES = 8;  // GameSession::collected has a bit per treasure
+const int SESSION_TOKEN_LENGTH = 32;
+const int MAX_PLACEMENT_ATTEMPTS = 32;  // uniform draws before falling back to a random walk
+
+inline int maxMoves = 8;
+inline int treasureCount = 3;   // treasures hidden in each new game
+inline int placementSlack = 0;  // spare moves every new game leaves over its best route
+
+// The "rooms" array of /api/state serialized up front with every treasure
+// flag false; room r's flag is at roomsJsonFlagPos[r].
+inline std::string roomsJson;
+inline std::vector<size_t> roomsJsonFlagPos;
+
+enum MoveResult {
+    MOVE_OK,
+    MOVE_TREASURE,
+    MOVE_GAME_WON,
+    MOVE_OUT_OF_MOVES,
+    MOVE_UNKNOWN_ROOM,
+    MOVE_NOT_CONNECTED
+};
+
+struct StateWaiter;  // server-side long-poll, see main.cpp
+
+// One-byte lock for a session. Requests hold it for microseconds, so a
+// waiter spins and yields rather than sleeping on a kernel object.
+struct SessionLock {
+    std::atomic<bool> held{false};
+
+    void lock() {
+        while (held.exchange(true, std::memory_order_acquire))
+            while (held.load(std::memory_order_relaxed)) std::this_thread::yield();
+    }
+    bool try_lock() { return !held.exchange(true, std::memory_order_acquire); }
+    void unlock() { held.store(false, std::memory_order_release); }
+};
+
+// A distance field costs 5 bytes per room, so on big maps only as many
+// games as fit in this budget keep one; the rest search on each query
+inline size_t proximityFieldBytes = 256u << 20;
+inline std::atomic<size_t> proximityFieldsHeld{0};
+
+// Parts of a session only needed while it is being played, allocated on
+// first use and dropped again once the game goes idle
+struct SessionExtras {
+    std::shared_ptr<const std::string> cachedState;  // /api/state body for cachedStateVersion
+    unsigned cachedStateVersion = 0;
+    std::vector<std::shared_ptr<StateWaiter>> waiters;
+    DistanceField proximity;  // to the nearest hidden treasure, built on first use
+    uint64_t proximitySeed = 0;     // layout the field was built for
+    uint8_t proximityCollected = 0; // treasures already removed from it
+    bool proximityHeld = false;     // counted in proximityFieldsHeld
+
+    ~SessionExtras() {
+        if (proximityHeld) proximityFieldsHeld.fetch_sub(1, std::memory_order_relaxed);
+    }
+};
+
+// Per-player game state, packed so millions of idle games stay resident:
+// rooms are indices, the treasures are a fixed list of rooms with a bitmask
+// of those collected, and the counters take a few bytes each.
+struct GameSession {
+    char token[SESSION_TOKEN_LENGTH] = {};
+    uint64_t seed = 0;  // treasure layout of the current game
+    std::unique_ptr<SessionExtras> extras;
+    uint32_t version = 0;     // bumped on every change to the game
+    uint32_t lastActive = 0;  // time(0) of the last request
+    uint32_t startedAt = 0;   // time(0) the current game began
+    int32_t currentRoom = 0;
+    int32_t treasures[MAX_TREASURES] = {};  // rooms in index order, the first treasureCount used
+    int16_t bestMoves = -1;  // fewest moves that collect every treasure from the entrance, -1 if over budget
+    uint16_t moves = 0;
+    uint8_t treasureCount = 0;
+    uint8_t collected = 0;  // bit i set once treasures[i] is found
+    bool hintUsed = false;
+    SessionLock lock;  // held while a request reads or changes this game
+
+    std::string_view tokenView() const { return std::string_view(token, SESSION_TOKEN_LENGTH); }
+
+    int treasuresFound() const {
+        int found = 0;
+        for (int i = 0; i < treasureCount; i++) found += (collected >> i) & 1;
+        return found;
+    }
+
+    // Index into treasures of an uncollected treasure in room, or -1
+    int treasureAt(int room) const {
+        for (int i = 0; i < treasureCount; i++)
+            if (treasures[i] == room && !((collected >> i) & 1)) return i;
+        return -1;
+    }
+
+    SessionExtras& extra() {
+        if (!extras) extras.reset(new SessionExtras);
+        return *extras;
+    }
+};
+
+// Every session in memory pays for each byte here; grow it on purpose
+static_assert(sizeof(GameSession) <= 104, "GameSession grew past 104 bytes");
+
+// Fixed-size objects carved out of slabs of SLAB_SLOTS. Freed slots go on
+// a free list and are reused before another slab is allocated, so a
+// million sessions take a few hundred allocations. Not thread-safe; each
+// session shard keeps its own pool under the shard lock.
+template <typename T>
+class SlabPool {
+public:
+    static const size_t SLAB_SLOTS = 1024;
+
+    template <typename... Args>
+    T* create(Args&&... args) {
+        if (!freeList) grow();
+        Slot* slot = freeList;
+        freeList = slot->next;
+        live++;
+        return new (slot->storage) T(std::forward<Args>(args)...);
+    }
+
+    void destroy(T* object) {
+        object->~T();
+        Slot* slot = reinterpret_cast<Slot*>(object);
+        slot->next = freeList;
+        freeList = slot;
+        live--;
+    }
+
+    size_t size() const { return live; }
+    size_t bytes() const { return slabs.size() * SLAB_SLOTS * sizeof(Slot); }
+
+private:
+    union Slot {
+        Slot* next;
+        alignas(T) unsigned char storage[sizeof(T)];
+    };
+
+    void grow() {
+        slabs.emplace_back(new Slot[SLAB_SLOTS]);
+        Slot* slab = slabs.back().get();
+        for (size_t i = SLAB_SLOTS; i-- > 0;) {
+            slab[i].next = freeList;
+            freeList = &slab[i];
+        }
+    }
+
+    std::vector<std::unique_ptr<Slot[]>> slabs;
+    Slot* freeList = nullptr;
+    size_t live = 0;
+};
+
+// Appends s as a JSON string literal
+inline void appendJsonString(std::string& out, std::string_view s) {
+    out += '"';
+    for (char c : s) {
+        if (c == '"' || c == '\\') {
+            out += '\\';
+            out += c;
+        } else if ((unsigned char)c < 0x20) {
+            out += ' ';
+        } else {
+            out += c;
+        }
+    }
+    out += '"';
+}
+
+inline void buildStateTemplate() {
+    int roomCount = castle.roomCount;
+    roomsJson.clear();
+    roomsJsonFlagPos.resize(roomCount);
+    for (int i = 0; i < roomCount; i++) {
+        if (i > 0) roomsJson += ",";
+        roomsJson += "{\"name\":";
+        appendJsonString(roomsJson, castle.name(i));
+        roomsJson += ",\"hasTreasure\":";
+        roomsJsonFlagPos[i] = roomsJson.size();
+        roomsJson += "false,\"adjacent\":[";
+        for (const int* n = castle.begin(i); n != castle.end(i); n++) {
+            if (n != castle.begin(i)) roomsJson += ",";
+            appendJsonString(roomsJson, castle.name(*n));
+        }
+        roomsJson += "]}";
+    }
+}
+
+inline void installGameMap(CastleGraph&& graph) {
+    installCastle(std::move(graph));
+    buildStateTemplate();
+}
+
+// Loads a map file, or the built-in castle if path is empty, and makes it
+// the castle every game is played on
+inline bool loadGameMap(const std::string& path, std::string& error) {
+    CastleGraph graph;
+    bool loaded;
+    if (path.empty()) {
+        CastleBuilder builder;
+        loaded = parseCastleText(DEFAULT_CASTLE_MAP, builder, error) && builder.build(graph, error);
+    } else {
+        loaded = loadCastleFile(path, graph, error);
+    }
+    if (!loaded) return false;
+    if (graph.roomCount <= treasureCount) {
+        error = "a castle needs at least " + std::to_string(treasureCount + 1) + " rooms to hide "
+              + std::to_string(treasureCount) + " treasures";
+        return false;
+    }
+
+    installGameMap(std::move(graph));
+    return true;
+}
+
+inline std::string getHint(GameSession& session) {
+    if (session.hintUsed) {
+        return "Out of hints! You've already used your one hint for this quest.";
+    }
+
+    for (int i = 0; i < session.treasureCount; i++) {
+        int room = session.treasures[i];
+        if (!((session.collected >> i) & 1)) {
+            session.hintUsed = true;
+            session.version++;
+
+            if (!castle.hint(room).empty()) return std::string(castle.hint(room));
+            return "A treasure awaits in " + std::string(castle.name(room)) + "...";
+        }
+    }
+
+    return "No treasures remain to find!";
+}
+
+// The session's distance field, brought up to date: treasures collected
+// since the last call are removed from it one by one, and it is rebuilt
+// only for a new layout or map. nullptr if proximityFieldBytes is taken up
+// by other games.
+inline const DistanceField* treasureField(GameSession& session) {
+    SessionExtras& extras = session.extra();
+    if (!extras.proximityHeld) {
+        size_t fieldBytes = (size_t)castle.roomCount * (sizeof(int32_t) + sizeof(uint8_t));
+        if (proximityFieldsHeld.fetch_add(1, std::memory_order_relaxed) >= proximityFieldBytes / fieldBytes) {
+            proximityFieldsHeld.fetch_sub(1, std::memory_order_relaxed);
+            return nullptr;
+        }
+        extras.proximityHeld = true;
+    }
+    DistanceField& field = extras.proximity;
+    bool sameLayout = field.generation == castleGeneration.load() && extras.proximitySeed == session.seed
+                      && field.sources.size() == (size_t)session.treasureCount
+                      && (extras.proximityCollected & ~session.collected) == 0;
+
+    if (!sameLayout) {
+        std::vector<int> sources(session.treasures, session.treasures + session.treasureCount);
+        for (int i = 0; i < session.treasureCount; i++)
+            if ((session.collected >> i) & 1) sources[i] = -1;
+        field.build(sources);
+        extras.proximitySeed = session.seed;
+    } else {
+        for (int i = 0; i < session.treasureCount; i++)
+            if (((session.collected & ~extras.proximityCollected) >> i) & 1) field.removeSource(i);
+    }
+    extras.proximityCollected = session.collected;
+    return &field;
+}
+
+inline MoveResult movePlayer(GameSession& session, int targetRoom) {
+    if (session.treasuresFound() >= session.treasureCount) {
+        return MOVE_GAME_WON;
+    }
+    if (session.moves >= maxMoves) {
+        return MOVE_OUT_OF_MOVES;
+    }
+
+    if (targetRoom < 0 || targetRoom >= castle.roomCount) {
+        return MOVE_UNKNOWN_ROOM;
+    }
+
+    if (!castle.connected(session.currentRoom, targetRoom)) {
+        return MOVE_NOT_CONNECTED;
+    }
+
+    session.currentRoom = targetRoom;
+    session.moves++;
+    session.version++;
+
+    int treasure = session.treasureAt(targetRoom);
+    if (treasure >= 0) {
+        session.collected |= (uint8_t)(1 << treasure);
+        if (session.extras && session.extras->proximityHeld) treasureField(session);
+        return MOVE_TREASURE;
+    }
+
+    return MOVE_OK;
+}
+
+inline std::string moveMessage(MoveResult result, std::string_view room) {
+    switch (result) {
+        case MOVE_OK: return "SUCCESS:Moved to " + std::string(room);
+        case MOVE_TREASURE: return "TREASURE:Found treasure in " + std::string(room);
+        case MOVE_GAME_WON: return "ERROR:Game already won";
+        case MOVE_OUT_OF_MOVES: return "ERROR:Out of moves";
+        case MOVE_UNKNOWN_ROOM: return "ERROR:Room not found";
+        default: return "ERROR:Rooms are not connected";
+    }
+}
+
+// Rooms that hold a treasure now, or held one when the game started
+inline std::vector<int> treasureRooms(const GameSession& session, bool original) {
+    std::vector<int> found;
+    for (int i = 0; i < session.treasureCount; i++)
+        if (original || !((session.collected >> i) & 1)) found.push_back(session.treasures[i]);
+    return found;
+}
+
+// Moves from room to the nearest treasure still hidden, -1 if none is within
+// the moves the game has left: an array read when the game holds a distance
+// field, otherwise one search outward from room that stops at that depth
+inline int treasureDistance(GameSession& session, int room) {
+    int movesLeft = std::max(maxMoves - session.moves, 0);
+    if (const DistanceField* field = treasureField(session)) {
+        int d = field->distance(room);
+        return d <= movesLeft ? d : -1;
+    }
+
+    countMetric(PROXIMITY_SEARCHES);
+    std::vector<int> hidden = treasureRooms(session, false);
+    std::vector<int> dist(hidden.size());
+    distancesWithin(room, hidden, movesLeft, dist.data());
+    int nearest = -1;
+    for (int d : dist)
+        if (d >= 0 && (nearest < 0 || d < nearest)) nearest = d;
+    return nearest;
+}
+
+// splitmix64: a few multiplies per number, and any 64-bit seed is a valid
+// state, so a game's layout can be reproduced from its seed alone
+struct GameRng {
+    uint64_t state;
+
+    explicit GameRng(uint64_t seed) : state(seed) {}
+
+    uint64_t next() {
+        uint64_t z = (state += 0x9e3779b97f4a7c15ULL);
+        z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+        z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+        return z ^ (z >> 31);
+    }
+
+    // Uniform in [0, n) by multiply-shift instead of a division
+    uint32_t below(uint32_t n) { return (uint32_t)(((next() >> 32) * n) >> 32); }
+};
+
+inline uint64_t newGameSeed() {
+    thread_local GameRng source(((uint64_t)std::random_device{}() << 32) ^ std::random_device{}());
+    return source.next();
+}
+
+// Rooms a treasure may go in: those within the move budget of the entrance,
+// read off the entrance's route table. Rebuilt when the map, budget or
+// treasure count changes.
+struct PlacementPool {
+    unsigned generation = 0;
+    int budget = -1;
+    int treasures = 0;
+    std::vector<int> rooms;
+
+    bool matches(unsigned g, int b) const { return generation == g && budget == b && treasures == treasureCount; }
+};
+
+inline std::mutex placementLock;
+inline std::shared_ptr<const PlacementPool> placementPool;
+
+inline std::shared_ptr<const PlacementPool> getPlacementPool(int budget) {
+    unsigned generation = castleGeneration.load();
+    thread_local std::shared_ptr<const PlacementPool> local;  // skips the lock on most resets
+    if (local && local->matches(generation, budget)) return local;
+    {
+        std::lock_guard<std::mutex> guard(placementLock);
+        if (placementPool && placementPool->matches(generation, budget)) {
+            local = placementPool;
+            return local;
+        }
+    }
+
+    auto pool = std::make_shared<PlacementPool>();
+    pool->generation = generation;
+    pool->budget = budget;
+    pool->treasures = treasureCount;
+    std::shared_ptr<const RouteTable> fromEntrance = getRouteTable(castle.entrance);
+    for (int r = 0; r < castle.roomCount; r++)
+        if (fromEntrance->dist[r] > 0 && fromEntrance->dist[r] <= budget) pool->rooms.push_back(r);
+
+    // No winnable layout exists, so at least keep the game playable
+    if ((int)pool->rooms.size() < treasureCount) {
+        logMessage(LOG_WARN, "Fewer than %d rooms within %d moves of the entrance; games may be unwinnable",
+                   treasureCount, budget);
+        pool->rooms.clear();
+        for (int r = 0; r < castle.roomCount; r++)
+            if (r != castle.entrance) pool->rooms.push_back(r);
+    }
+
+    std::lock_guard<std::mutex> guard(placementLock);
+    placementPool = pool;
+    local = pool;
+    return pool;
+}
+
+// Fewest moves that collect the given treasures from the entrance, or -1
+// (or anything above limit) if it takes more than limit. Small maps read
+// the precomputed route tables. Big ones search around each treasure, but
+// only as far as a route through it could still go: a route reaches
+// treasure t after at least dist(entrance, t) moves.
+inline int layoutMoves(const std::vector<int>& rooms, int limit) {
+    if (castle.roomCount <= PRECOMPUTED_ROUTE_ROOMS) return planTour(castle.entrance, rooms).moves;
+
+    // Every layout is measured from the entrance, so each thread keeps that
+    // table rather than going through the shared route cache per placement
+    thread_local unsigned entranceGeneration = ~0u;
+    thread_local std::shared_ptr<const RouteTable> fromEntrance;
+    unsigned generation = castleGeneration.load(std::memory_order_acquire);
+    if (!fromEntrance || entranceGeneration != generation) {
+        fromEntrance = getRouteTable(castle.entrance);
+        entranceGeneration = generation;
+    }
+
+    int k = (int)rooms.size();
+    std::vector<int> dist((k + 1) * k);
+    for (int j = 0; j < k; j++) dist[k * k + j] = fromEntrance->dist[rooms[j]];
+    for (int i = 0; i < k; i++) {
+        if (dist[k * k + i] < 0 || dist[k * k + i] > limit) return -1;
+        distancesWithin(rooms[i], rooms, limit - dist[k * k + i], &dist[i * k]);
+    }
+    return planTourFromDistances(rooms, dist).moves;
+}
+
+// Treasures picked from the rooms along a random walk of `length` moves
+// from the entrance, so they can always be collected in that many moves.
+// Returns false if the walk did not pass enough different rooms.
+inline bool walkLayout(GameRng& rng, int length, std::vector<int>& chosen) {
+    std::vector<int> visited;
+    int current = castle.entrance, previous = -1;
+    for (int step = 0; step < length && castle.degree(current) > 0; step++) {
+        // Avoid stepping straight back unless it is the only way on
+        int next = castle.begin(current)[rng.below((uint32_t)castle.degree(current))];
+        if (next == previous && castle.degree(current) > 1)
+            next = castle.begin(current)[rng.below((uint32_t)castle.degree(current))];
+        previous = current;
+        current = next;
+        if (current != castle.entrance && std::find(visited.begin(), visited.end(), current) == visited.end())
+            visited.push_back(current);
+    }
+    if ((int)visited.size() < treasureCount) return false;
+
+    chosen.clear();
+    while ((int)chosen.size() < treasureCount) {
+        int r = visited[rng.below((uint32_t)visited.size())];
+        if (std::find(chosen.begin(), chosen.end(), r) == chosen.end()) chosen.push_back(r);
+    }
+    return true;
+}
+
+// Places the treasures for a game from its seed. Layouts are drawn
+// uniformly from rooms in reach of the entrance, and any that cannot be
+// collected within maxMoves - placementSlack moves are rejected and
+// redrawn. If that keeps failing, as on big maps where few layouts fit,
+// the layout comes from a random walk instead.
+inline void placeTreasures(GameSession& session, uint64_t seed) {
+    GameRng rng(seed);
+    int budget = maxMoves - placementSlack;
+    std::shared_ptr<const PlacementPool> pool = getPlacementPool(budget);
+
+    std::vector<int> chosen, accepted;
+    int acceptedMoves = -1;
+    for (int attempt = 0; attempt < MAX_PLACEMENT_ATTEMPTS; attempt++) {
+        chosen.clear();
+        while ((int)chosen.size() < treasureCount) {
+            int r = pool->rooms[rng.below((uint32_t)pool->rooms.size())];
+            if (std::find(chosen.begin(), chosen.end(), r) == chosen.end()) chosen.push_back(r);
+        }
+
+        int moves = layoutMoves(chosen, budget);
+        if (accepted.empty() || (moves >= 0 && moves <= budget)) {
+            accepted = chosen;
+            acceptedMoves = moves;
+        }
+        if (moves >= 0 && moves <= budget) break;
+    }
+    for (int attempt = 0; attempt < MAX_PLACEMENT_ATTEMPTS && (acceptedMoves < 0 || acceptedMoves > budget); attempt++) {
+        if (!walkLayout(rng, budget, chosen)) continue;
+        accepted = chosen;
+        acceptedMoves = layoutMoves(chosen, budget);
+    }
+    if (acceptedMoves < 0 || acceptedMoves > budget) {
+        logMessage(LOG_WARN, "No treasure layout fits in %d moves after %d attempts", budget, MAX_PLACEMENT_ATTEMPTS);
+        acceptedMoves = -1;
+    }
+
+    std::sort(accepted.begin(), accepted.end());
+    session.treasureCount = (uint8_t)accepted.size();
+    for (int i = 0; i < session.treasureCount; i++) {
+        session.treasures[i] = accepted[i];
+        logMessage(LOG_DEBUG, "Treasure placed in: %.*s", (int)castle.name(accepted[i]).size(), castle.name(accepted[i]).data());
+    }
+    session.collected = 0;
+    session.bestMoves = (int16_t)acceptedMoves;
+    logMessage(LOG_DEBUG, "All treasures reachable in %d moves (limit %d)", session.bestMoves, maxMoves);
+}
+
+// Starts a new game. The seed decides the treasure layout.
+inline void resetGame(GameSession& session, uint64_t seed = newGameSeed()) {
+    session.currentRoom = castle.entrance;
+    session.moves = 0;
+    session.hintUsed = false;
+    session.startedAt = (uint32_t)time(0);
+    session.seed = seed;
+    session.version++;
+    placeTreasures(session, seed);
+}
+
+// The state document is rebuilt only after the game changes; polls in
+// between get the cached copy.
+inline std::shared_ptr<const std::string> getGameState(GameSession& session) {
+    SessionExtras& extras = session.extra();
+    if (extras.cachedState && extras.cachedStateVersion == session.version) {
+        return extras.cachedState;
+    }
+
+    MetricTimer timer(TIME_STATE_SERIALIZE);
+    int found = session.treasuresFound();
+    bool won = found >= session.treasureCount && session.moves <= maxMoves;
+    bool gameOver = found >= session.treasureCount || session.moves >= maxMoves;
+
+    std::string json;
+    json.reserve(roomsJson.size() + 512);
+    json += "{\"session\":\"";
+    json += session.tokenView();
+    json += "\",\"version\":";
+    json += std::to_string(session.version);
+    json += ",\"currentRoom\":";
+    appendJsonString(json, castle.name(session.currentRoom));
+    json += ",\"entrance\":";
+    appendJsonString(json, castle.name(castle.entrance));
+    json += ",\"treasuresFound\":";
+    json += std::to_string(found);
+    json += ",\"treasureCount\":";
+    json += std::to_string(session.treasureCount);
+    json += ",\"moves\":";
+    json += std::to_string(session.moves);
+    json += ",\"maxMoves\":";
+    json += std::to_string(maxMoves);
+    json += ",\"bestMoves\":";
+    json += std::to_string(session.bestMoves);
+    json += ",\"hintUsed\":";
+    json += session.hintUsed ? "true" : "false";
+    json += ",\"gameOver\":";
+    json += gameOver ? "true" : "false";
+    json += ",\"won\":";
+    json += won ? "true" : "false";
+    json += ",\"treasureLocations\":[";
+
+    std::vector<int> original = treasureRooms(session, true);
+    for (size_t i = 0; i < original.size(); i++) {
+        if (i > 0) json += ",";
+        appendJsonString(json, castle.name(original[i]));
+    }
+    json += "],\"rooms\":[";
+
+    // Copy the prebuilt room list and flip the flags of the treasure rooms;
+    // "true " keeps the length of "false"
+    size_t base = json.size();
+    json += roomsJson;
+    for (int room : treasureRooms(session, false)) memcpy(&json[base + roomsJsonFlagPos[room]], "true ", 5);
+    json += "]}";
+
+    extras.cachedState = std::make_shared<const std::string>(std::move(json));
+    extras.cachedStateVersion = session.version;
+    return extras.cachedState;
+}
+
+#endif
@@ -0,0 +1,532 @@
+// Saved games. Every change to a game is appended to a write-ahead journal,
+// and every so often all sessions are written out as a compact snapshot.
+// On startup the snapshot is loaded and the journal replayed on top of it.
+//
+// Appending only copies a fixed-size record into the current batch. A
+// writer thread writes each batch with one write and one fsync (group
+// commit), then runs the callbacks waiting on it, so a reply can be held
+// back until its move is on disk without a sync per move. A batch that
+// cannot be written is kept and retried in a fresh segment; until a retry
+// succeeds, its callbacks are told it was not saved and journalFailed is set
+// so no new changes are taken on.
+//
+// Files in the data directory:
+//   snapshot.bin   all sessions, taken while segment N was current
+//   journal-N.log  events from then on; a snapshot starts a new segment
+
+#ifndef JOURNAL_H
+#define JOURNAL_H
+
+#include "game.h"
+
+#include <condition_variable>
+#include <functional>
+#include <cerrno>
+#ifdef _WIN32
+    #include <direct.h>
+    #include <io.h>
+#endif
+
+const uint32_t JOURNAL_MAGIC = 0x4c4e4a43;   // "CJNL" little-endian
+const uint32_t SNAPSHOT_MAGIC = 0x504e5343;  // "CSNP" little-endian
+const uint32_t JOURNAL_FORMAT_VERSION = 2;
+
+enum JournalEvent : uint8_t { EVENT_RESET = 1, EVENT_MOVE = 2, EVENT_HINT = 3 };
+
+// Starts both file kinds
+struct JournalFileHeader {
+    uint32_t magic;
+    uint32_t version;
+    uint64_t fingerprint;  // castle and placement settings the games were played with
+    uint32_t segment;      // journal: its own number; snapshot: first segment to replay
+    uint32_t count;        // snapshot: sessions that follow; journal: unused
+};
+
+// One game event. A record whose checksum does not match is a torn write
+// at the end of a segment, and it and anything after it are ignored.
+struct JournalRecord {
+    uint32_t checksum;  // of the rest of the record
+    uint32_t version;   // session version after the event
+    uint64_t value;     // reset: seed, move: room
+    uint8_t event;
+    uint8_t reserved[7];
+    char token[32];
+};
+
+// One session in a snapshot. The file ends with a checksum of everything
+// before it.
+struct SnapshotSession {
+    char token[32];
+    uint64_t seed;
+    uint32_t version;
+    int32_t currentRoom;
+    int32_t moves;
+    int32_t bestMoves;
+    int32_t treasures[MAX_TREASURES];  // layout at the start, the first treasureCount used
+    uint8_t treasureCount;
+    uint8_t collected;  // bit i set once treasures[i] is found
+    uint8_t hintUsed;
+    uint8_t reserved[5];
+};
+
+struct Journal {
+    std::string dir;
+    uint64_t fingerprint = 0;
+    int fd = -1;                 // current segment, writer thread only after startup
+    uint64_t segmentBytes = 0;   // length of the current segment known to hold whole records
+    uint32_t segment = 0;        // number of the current segment
+    uint32_t oldestSegment = 0;  // first segment still on disk
+
+    std::mutex lock;
+    std::condition_variable wake;     // work for the writer
+    std::condition_variable rotated;  // a requested segment switch is done
+    std::string batch;                // records appended but not yet written
+    uint64_t appended = 0;            // sequence number of the last record appended
+    uint64_t durable = 0;             // records up to here are on disk
+    bool writerIdle = false;
+    bool rotateRequested = false;
+    std::vector<std::pair<uint64_t, std::function<void(bool saved)>>> waiting;  // run once written or failed
+};
+
+inline Journal journal;
+inline std::atomic<bool> journalEnabled{false};
+inline std::atomic<bool> journalFailed{false};  // the last write failed and is being retried
+
+inline uint32_t journalChecksum(const char* data, size_t size) {
+    uint32_t h = 2166136261u;
+    for (size_t i = 0; i < size; i++) {
+        h ^= (unsigned char)data[i];
+        h *= 16777619u;
+    }
+    return h;
+}
+
+// Placement settings are part of it because a reset is replayed from its seed
+inline uint64_t journalFingerprint() {
+    uint64_t h = castleFingerprint(castle);
+    h = (h ^ (uint64_t)maxMoves) * 1099511628211ULL;
+    h = (h ^ (uint64_t)placementSlack) * 1099511628211ULL;
+    h = (h ^ (uint64_t)treasureCount) * 1099511628211ULL;
+    return h;
+}
+
+inline std::string journalSegmentPath(uint32_t segment) {
+    return journal.dir + "/journal-" + std::to_string(segment) + ".log";
+}
+
+inline std::string snapshotPath() {
+    return journal.dir + "/snapshot.bin";
+}
+
+// Thin wrappers over the unbuffered file calls, which differ on Windows
+inline int createDataFile(const std::string& path) {
+#ifdef _WIN32
+    return _open(path.c_str(), _O_WRONLY | _O_CREAT | _O_TRUNC | _O_BINARY, _S_IREAD | _S_IWRITE);
+#else
+    return open(path.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+#endif
+}
+
+inline bool writeDataFile(int fd, const char* data, size_t size) {
+    while (size > 0) {
+#ifdef _WIN32
+        int written = _write(fd, data, (unsigned)std::min<size_t>(size, 1 << 30));
+#else
+        ssize_t written = write(fd, data, size);
+        if (written < 0 && errno == EINTR) continue;
+#endif
+        if (written <= 0) return false;
+        data += written;
+        size -= (size_t)written;
+    }
+    return true;
+}
+
+inline bool syncDataFile(int fd) {
+#ifdef _WIN32
+    return _commit(fd) == 0;
+#else
+    return fsync(fd) == 0;
+#endif
+}
+
+// Cuts a file back to size and moves the write position there
+inline bool truncateDataFile(int fd, uint64_t size) {
+#ifdef _WIN32
+    return _chsize_s(fd, (__int64)size) == 0 && _lseeki64(fd, (__int64)size, SEEK_SET) == (__int64)size;
+#else
+    return ftruncate(fd, (off_t)size) == 0 && lseek(fd, (off_t)size, SEEK_SET) == (off_t)size;
+#endif
+}
+
+inline void closeDataFile(int fd) {
+#ifdef _WIN32
+    _close(fd);
+#else
+    close(fd);
+#endif
+}
+
+inline bool replaceDataFile(const std::string& from, const std::string& to) {
+#ifdef _WIN32
+    return MoveFileExA(from.c_str(), to.c_str(), MOVEFILE_REPLACE_EXISTING | MOVEFILE_WRITE_THROUGH) != 0;
+#else
+    if (rename(from.c_str(), to.c_str()) != 0) return false;
+    // Make the rename itself durable
+    int dirFd = open(journal.dir.c_str(), O_RDONLY);
+    if (dirFd != -1) {
+        fsync(dirFd);
+        close(dirFd);
+    }
+    return true;
+#endif
+}
+
+inline bool makeDataDirectory(const std::string& path) {
+#ifdef _WIN32
+    return _mkdir(path.c_str()) == 0 || errno == EEXIST;
+#else
+    return mkdir(path.c_str(), 0755) == 0 || errno == EEXIST;
+#endif
+}
+
+inline bool readDataFile(const std::string& path, std::string& out) {
+    std::ifstream in(path, std::ios::binary);
+    if (!in) return false;
+    out.assign(std::istreambuf_iterator<char>(in), std::istreambuf_iterator<char>());
+    return true;
+}
+
+// Creates a segment holding just its header. A segment whose header could
+// not be written is removed again, so replay never meets a stub.
+inline int openJournalSegment(uint32_t segment) {
+    int fd = createDataFile(journalSegmentPath(segment));
+    if (fd == -1) return -1;
+    JournalFileHeader header = { JOURNAL_MAGIC, JOURNAL_FORMAT_VERSION, journal.fingerprint, segment, 0 };
+    if (!writeDataFile(fd, (const char*)&header, sizeof(header)) || !syncDataFile(fd)) {
+        int savedErrno = errno;
+        closeDataFile(fd);
+        remove(journalSegmentPath(segment).c_str());
+        errno = savedErrno;
+        return -1;
+    }
+    return fd;
+}
+
+// Queues an event and returns its sequence number, or 0 when saving is
+// off. Called with the session locked, so a game's records are in order.
+inline uint64_t appendJournal(JournalEvent event, const GameSession& session, uint64_t value) {
+    if (!journalEnabled.load(std::memory_order_relaxed)) return 0;
+
+    JournalRecord record = {};
+    record.event = event;
+    record.version = session.version;
+    memcpy(record.token, session.token, sizeof(record.token));
+    record.value = value;
+    record.checksum = journalChecksum((const char*)&record + 4, sizeof(record) - 4);
+
+    std::lock_guard<std::mutex> guard(journal.lock);
+    journal.batch.append((const char*)&record, sizeof(record));
+    if (journal.writerIdle) journal.wake.notify_one();
+    return ++journal.appended;
+}
+
+inline uint64_t journalReset(const GameSession& session) {
+    return appendJournal(EVENT_RESET, session, session.seed);
+}
+
+inline uint64_t journalMove(const GameSession& session) {
+    return appendJournal(EVENT_MOVE, session, (uint64_t)session.currentRoom);
+}
+
+inline uint64_t journalHint(const GameSession& session) {
+    return appendJournal(EVENT_HINT, session, 0);
+}
+
+// Runs fn(true) once record `sequence` is on disk: right away if it
+// already is, otherwise on the writer thread after the batch holding it is
+// synced. fn(false) if that batch could not be written.
+inline void whenDurable(uint64_t sequence, std::function<void(bool saved)> fn) {
+    {
+        std::lock_guard<std::mutex> guard(journal.lock);
+        if (sequence > journal.durable) {
+            journal.waiting.emplace_back(sequence, std::move(fn));
+            return;
+        }
+    }
+    fn(true);
+}
+
+inline void runJournalWriter() {
+    std::string writing;  // survives a failed attempt, to be retried
+    std::vector<std::function<void(bool)>> ready;
+    bool torn = false;    // the current segment may end in a partial record
+    while (true) {
+        // Give a failing disk a moment before trying again
+        if (journalFailed.load(std::memory_order_relaxed)) std::this_thread::sleep_for(std::chrono::seconds(1));
+
+        uint64_t upTo;
+        bool requested;
+        {
+            std::unique_lock<std::mutex> guard(journal.lock);
+            journal.writerIdle = true;
+            journal.wake.wait(guard, [&writing] {
+                return !writing.empty() || !journal.batch.empty() || journal.rotateRequested;
+            });
+            journal.writerIdle = false;
+            writing += journal.batch;
+            journal.batch.clear();
+            upTo = journal.appended;
+            requested = journal.rotateRequested;
+        }
+
+        // Replay stops at the first torn record in a segment, so nothing is
+        // ever written after one: a failed batch is cut off again, and if
+        // that fails too the retry waits for a new segment. Records of the
+        // batch that did land are skipped on replay by version.
+        bool saved = !torn;
+        bool rotate = requested || torn;
+        if (!writing.empty() && !torn) {
+            MetricTimer timer(TIME_JOURNAL_COMMIT);
+            if (writeDataFile(journal.fd, writing.data(), writing.size()) && syncDataFile(journal.fd)) {
+                journal.segmentBytes += writing.size();
+            } else {
+                logMessage(LOG_ERROR, "Cannot write journal segment %u: %s", journal.segment, strerror(errno));
+                saved = false;
+                rotate = true;
+                if (!truncateDataFile(journal.fd, journal.segmentBytes) || !syncDataFile(journal.fd)) torn = true;
+            }
+        }
+
+        uint32_t segment = journal.segment;
+        if (rotate) {
+            int fd = openJournalSegment(segment + 1);
+            if (fd == -1) {
+                logMessage(LOG_ERROR, "Cannot start journal segment %u: %s", segment + 1, strerror(errno));
+            } else {
+                closeDataFile(journal.fd);
+                journal.fd = fd;
+                journal.segmentBytes = sizeof(JournalFileHeader);
+                torn = false;
+                segment++;
+            }
+        }
+
+        {
+            std::lock_guard<std::mutex> guard(journal.lock);
+            if (saved) journal.durable = upTo;
+            journal.segment = segment;
+            if (requested) {
+                journal.rotateRequested = false;
+                journal.rotated.notify_all();
+            }
+            auto done = std::partition(journal.waiting.begin(), journal.waiting.end(),
+                                       [upTo](const auto& w) { return w.first > upTo; });
+            for (auto it = done; it != journal.waiting.end(); ++it) ready.push_back(std::move(it->second));
+            journal.waiting.erase(done, journal.waiting.end());
+        }
+        if (saved) writing.clear();
+        if (journalFailed.exchange(!saved) && saved) logMessage(LOG_INFO, "Journal writes have recovered");
+        for (auto& fn : ready) fn(saved);
+        ready.clear();
+    }
+}
+
+// Makes the writer finish the current segment and start a new one.
+// Returns the new segment's number.
+inline uint32_t rotateJournal() {
+    std::unique_lock<std::mutex> guard(journal.lock);
+    journal.rotateRequested = true;
+    journal.wake.notify_one();
+    journal.rotated.wait(guard, [] { return !journal.rotateRequested; });
+    return journal.segment;
+}
+
+inline void saveSession(const GameSession& session, std::string& out) {
+    SnapshotSession saved = {};
+    memcpy(saved.token, session.token, sizeof(saved.token));
+    saved.seed = session.seed;
+    saved.version = session.version;
+    saved.currentRoom = session.currentRoom;
+    saved.moves = session.moves;
+    saved.bestMoves = session.bestMoves;
+    for (int i = 0; i < MAX_TREASURES; i++) saved.treasures[i] = i < session.treasureCount ? session.treasures[i] : -1;
+    saved.treasureCount = session.treasureCount;
+    saved.collected = session.collected;
+    saved.hintUsed = session.hintUsed;
+    out.append((const char*)&saved, sizeof(saved));
+}
+
+inline void restoreSession(const SnapshotSession& saved, GameSession& session) {
+    session.seed = saved.seed;
+    session.version = saved.version;
+    session.currentRoom = saved.currentRoom;
+    session.moves = (uint16_t)saved.moves;
+    session.bestMoves = (int16_t)saved.bestMoves;
+    session.treasureCount = std::min<uint8_t>(saved.treasureCount, MAX_TREASURES);
+    for (int i = 0; i < session.treasureCount; i++) {
+        int r = saved.treasures[i];
+        session.treasures[i] = r >= 0 && r < castle.roomCount ? r : castle.entrance;
+    }
+    session.collected = saved.collected;
+    session.hintUsed = saved.hintUsed != 0;
+}
+
+// Calls its argument on every live session, with the session locked
+typedef std::function<void(const std::function<void(GameSession&)>&)> SessionVisitor;
+
+// Finds a session by token while saved games are loaded, adding an empty
+// one if create is set; nullptr if there is none
+typedef std::function<GameSession*(std::string_view token, bool create)> SessionFinder;
+
+// Writes every session to a new snapshot taken while segment `segment` is
+// current, then deletes the segments it makes redundant. Events already in
+// the snapshot and again in that segment are skipped on replay by version.
+inline bool writeSnapshot(const SessionVisitor& forEach, uint32_t segment, size_t& count, std::string& error) {
+    std::string image(sizeof(JournalFileHeader), '\0');
+    forEach([&image](GameSession& session) { saveSession(session, image); });
+    count = (image.size() - sizeof(JournalFileHeader)) / sizeof(SnapshotSession);
+    JournalFileHeader header = { SNAPSHOT_MAGIC, JOURNAL_FORMAT_VERSION, journal.fingerprint, segment, (uint32_t)count };
+    memcpy(&image[0], &header, sizeof(header));
+    uint32_t checksum = journalChecksum(image.data(), image.size());
+    image.append((const char*)&checksum, sizeof(checksum));
+
+    std::string temp = snapshotPath() + ".tmp";
+    int fd = createDataFile(temp);
+    if (fd == -1) {
+        error = "cannot create " + temp;
+        return false;
+    }
+    bool written = writeDataFile(fd, image.data(), image.size()) && syncDataFile(fd);
+    closeDataFile(fd);
+    if (!written || !replaceDataFile(temp, snapshotPath())) {
+        error = "cannot write " + snapshotPath() + ": " + strerror(errno);
+        return false;
+    }
+
+    for (uint32_t s = journal.oldestSegment; s < segment; s++) remove(journalSegmentPath(s).c_str());
+    journal.oldestSegment = segment;
+    return true;
+}
+
+// Snapshots every session. Only one snapshot may run at a time.
+inline void takeSnapshot(const SessionVisitor& forEach) {
+    auto start = std::chrono::steady_clock::now();
+    uint32_t segment = rotateJournal();
+    size_t count = 0;
+    std::string error;
+    if (!writeSnapshot(forEach, segment, count, error)) {
+        logMessage(LOG_ERROR, "Cannot save games: %s", error.c_str());
+        return;
+    }
+    double ms = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+    logMessage(LOG_INFO, "Saved %zu games in %.1f ms", count, ms);
+}
+
+// Applies one journal record to the replayed games
+inline void replayRecord(const JournalRecord& record, const SessionFinder& find) {
+    // Only a reset starts a game; other events for unknown games belong to
+    // games that expired before the snapshot
+    GameSession* session = find(std::string_view(record.token, sizeof(record.token)), record.event == EVENT_RESET);
+    if (!session || record.version <= session->version) return;  // gone, or already in the snapshot
+
+    switch (record.event) {
+        case EVENT_RESET: resetGame(*session, record.value); break;
+        case EVENT_MOVE: movePlayer(*session, (int)record.value); break;
+        case EVENT_HINT: getHint(*session); break;
+    }
+    session->version = record.version;
+}
+
+// Replays the segments from `first` on, stopping at the first one missing.
+// Returns the number of the first segment that does not exist.
+inline uint32_t replaySegments(uint32_t first, bool compatible, const SessionFinder& find, size_t& records) {
+    uint32_t segment = first;
+    std::string data;
+    for (; readDataFile(journalSegmentPath(segment), data); segment++) {
+        JournalFileHeader header;
+        if (data.size() < sizeof(header)) continue;
+        memcpy(&header, data.data(), sizeof(header));
+        if (header.magic != JOURNAL_MAGIC || header.version != JOURNAL_FORMAT_VERSION
+            || header.fingerprint != journal.fingerprint || !compatible) {
+            continue;
+        }
+
+        for (size_t pos = sizeof(header); pos + sizeof(JournalRecord) <= data.size(); pos += sizeof(JournalRecord)) {
+            JournalRecord record;
+            memcpy(&record, data.data() + pos, sizeof(record));
+            if (record.checksum != journalChecksum((const char*)&record + 4, sizeof(record) - 4)) {
+                logMessage(LOG_WARN, "Journal segment %u is cut short after %zu records", segment,
+                           (pos - sizeof(header)) / sizeof(JournalRecord));
+                break;
+            }
+            replayRecord(record, find);
+            records++;
+        }
+    }
+    return segment;
+}
+
+// Loads the saved games from dir and starts journaling new events there.
+// Games saved with another castle or other placement settings are dropped,
+// since their moves would not replay the same way.
+inline bool openJournal(const std::string& dir, const SessionFinder& find, std::string& error) {
+    journal.dir = dir;
+    journal.fingerprint = journalFingerprint();
+    if (!makeDataDirectory(dir)) {
+        error = "cannot create " + dir + ": " + strerror(errno);
+        return false;
+    }
+
+    uint32_t first = 1;
+    size_t snapshotGames = 0, records = 0;
+    bool compatible = true;
+    std::string data;
+    if (readDataFile(snapshotPath(), data)) {
+        JournalFileHeader header;
+        uint32_t checksum = 0;
+        if (data.size() >= sizeof(header) + 4) {
+            memcpy(&header, data.data(), sizeof(header));
+            memcpy(&checksum, data.data() + data.size() - 4, 4);
+        }
+        // The header is the same in every version, so an older snapshot still
+        // says which journal segments follow it
+        bool readable = data.size() >= sizeof(header) + 4 && header.magic == SNAPSHOT_MAGIC;
+        bool current = readable && header.version == JOURNAL_FORMAT_VERSION;
+        if (!readable || (current && (data.size() != sizeof(header) + (size_t)header.count * sizeof(SnapshotSession) + 4
+                                      || checksum != journalChecksum(data.data(), data.size() - 4)))) {
+            error = snapshotPath() + " is corrupt";
+            return false;
+        }
+
+        first = header.segment;
+        compatible = current && header.fingerprint == journal.fingerprint;
+        if (!compatible) {
+            logMessage(LOG_WARN, "Saved games are from another version, castle or settings; starting fresh");
+        }
+        for (uint32_t i = 0; compatible && i < header.count; i++) {
+            SnapshotSession saved;
+            memcpy(&saved, data.data() + sizeof(header) + (size_t)i * sizeof(saved), sizeof(saved));
+            restoreSession(saved, *find(std::string_view(saved.token, sizeof(saved.token)), true));
+        }
+        snapshotGames = compatible ? header.count : 0;
+    }
+    uint32_t next = replaySegments(first, compatible, find, records);
+
+    journal.oldestSegment = first;
+    journal.segment = next;
+    journal.fd = openJournalSegment(next);
+    journal.segmentBytes = sizeof(JournalFileHeader);
+    if (journal.fd == -1) {
+        error = "cannot create " + journalSegmentPath(next) + ": " + strerror(errno);
+        return false;
+    }
+
+    logMessage(LOG_INFO, "Loaded %zu games from the snapshot and %zu journal records", snapshotGames, records);
+
+    journalEnabled = true;
+    std::thread(runJournalWriter).detach();
+    return true;
+}
+
+#endif
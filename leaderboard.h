@@ -0,0 +1,171 @@
+// Leaderboard of completed games: the best LEADERBOARD_SIZE by moves used,
+// then by time taken, then by who finished first.
+//
+// Finishing games never wait on each other. Each worker thread appends to
+// its own buffer and folds it into the shared board once LEADERBOARD_BATCH
+// results have piled up; results that cannot make a full board are dropped
+// against an atomic cutoff before they are buffered at all. Readers get a
+// pre-serialized document, rebuilt (after collecting every buffer) at most
+// once per LEADERBOARD_REFRESH_MS.
+
+#ifndef LEADERBOARD_H
+#define LEADERBOARD_H
+
+#include "game.h"
+
+#include <atomic>
+#include <chrono>
+#include <memory>
+#include <mutex>
+
+const size_t LEADERBOARD_SIZE = 100;
+const size_t LEADERBOARD_BATCH = 64;
+const int LEADERBOARD_REFRESH_MS = 1000;
+
+struct LeaderboardEntry {
+    uint64_t rankKey;     // moves << 32 | seconds taken; lower ranks higher
+    uint64_t finishedMs;  // wall clock, breaks ties in favour of the earlier game
+    uint32_t player;      // hash of the session token, which is itself a credential
+    int16_t bestMoves;
+    uint8_t treasures;
+    bool hintUsed;
+
+    bool operator<(const LeaderboardEntry& other) const {
+        return rankKey != other.rankKey ? rankKey < other.rankKey : finishedMs < other.finishedMs;
+    }
+};
+
+struct LeaderboardBuffer {
+    std::mutex lock;  // taken by its own thread, and briefly by a refresh
+    std::vector<LeaderboardEntry> entries;
+    uint64_t completed = 0;  // games won on this thread, ranked or not
+};
+
+inline std::mutex leaderboardLock;  // guards the board and the buffer list
+inline std::vector<LeaderboardEntry> leaderboard;  // sorted, at most LEADERBOARD_SIZE
+inline std::vector<std::unique_ptr<LeaderboardBuffer>> leaderboardBuffers;  // never shrinks
+inline std::atomic<uint64_t> leaderboardCutoff{UINT64_MAX};  // rankKey a result must beat once the board is full
+
+inline std::mutex leaderboardRefreshLock;  // one rebuild at a time
+inline std::shared_ptr<const std::string> leaderboardJson;  // read and replaced with atomic_load/atomic_store
+inline std::atomic<int64_t> leaderboardJsonAt{0};
+
+inline int64_t leaderboardClockMs() {
+    return std::chrono::duration_cast<std::chrono::milliseconds>(
+        std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+inline LeaderboardBuffer& threadLeaderboardBuffer() {
+    thread_local LeaderboardBuffer* mine = [] {
+        std::lock_guard<std::mutex> guard(leaderboardLock);
+        leaderboardBuffers.emplace_back(new LeaderboardBuffer);
+        return leaderboardBuffers.back().get();
+    }();
+    return *mine;
+}
+
+// Folds a batch into the board. Called with no buffer lock held.
+inline void mergeLeaderboard(std::vector<LeaderboardEntry>& batch) {
+    if (batch.empty()) return;
+    std::sort(batch.begin(), batch.end());
+    std::lock_guard<std::mutex> guard(leaderboardLock);
+    size_t middle = leaderboard.size();
+    leaderboard.insert(leaderboard.end(), batch.begin(), batch.end());
+    std::inplace_merge(leaderboard.begin(), leaderboard.begin() + middle, leaderboard.end());
+    if (leaderboard.size() >= LEADERBOARD_SIZE) {
+        leaderboard.resize(LEADERBOARD_SIZE);
+        leaderboardCutoff.store(leaderboard.back().rankKey, std::memory_order_relaxed);
+    }
+}
+
+// Records a game that has just been won
+inline void recordCompletedGame(const GameSession& session) {
+    uint32_t now = (uint32_t)time(0);
+    uint64_t seconds = session.startedAt && now > session.startedAt ? now - session.startedAt : 0;
+    LeaderboardEntry entry;
+    entry.rankKey = (uint64_t)session.moves << 32 | (seconds < 0xffffffffULL ? seconds : 0xffffffffULL);
+    entry.finishedMs = std::chrono::duration_cast<std::chrono::milliseconds>(
+        std::chrono::system_clock::now().time_since_epoch()).count();
+    entry.player = hashRoomName(session.tokenView());
+    entry.bestMoves = session.bestMoves;
+    entry.treasures = session.treasureCount;
+    entry.hintUsed = session.hintUsed;
+
+    LeaderboardBuffer& buffer = threadLeaderboardBuffer();
+    std::vector<LeaderboardEntry> batch;
+    {
+        std::lock_guard<std::mutex> guard(buffer.lock);
+        buffer.completed++;
+        // A tie with the last place loses to the game already there
+        if (entry.rankKey >= leaderboardCutoff.load(std::memory_order_relaxed)) return;
+        buffer.entries.push_back(entry);
+        if (buffer.entries.size() < LEADERBOARD_BATCH) return;
+        batch.swap(buffer.entries);
+    }
+    mergeLeaderboard(batch);
+}
+
+inline std::string serializeLeaderboard(const std::vector<LeaderboardEntry>& board, uint64_t completed) {
+    std::string json = "{\"games\":" + std::to_string(completed) + ",\"entries\":[";
+    char player[9];
+    for (size_t i = 0; i < board.size(); i++) {
+        const LeaderboardEntry& e = board[i];
+        snprintf(player, sizeof(player), "%08x", e.player);
+        if (i > 0) json += ",";
+        json += "{\"rank\":" + std::to_string(i + 1);
+        json += ",\"player\":\"";
+        json += player;
+        json += "\",\"moves\":" + std::to_string(e.rankKey >> 32);
+        json += ",\"seconds\":" + std::to_string(e.rankKey & 0xffffffffULL);
+        json += ",\"bestMoves\":" + std::to_string(e.bestMoves);
+        json += ",\"treasures\":" + std::to_string(e.treasures);
+        json += ",\"hintUsed\":";
+        json += e.hintUsed ? "true" : "false";
+        json += ",\"finishedAt\":" + std::to_string(e.finishedMs / 1000);
+        json += "}";
+    }
+    json += "]}";
+    return json;
+}
+
+// The board as JSON. Fresh copies are shared by every reader; when one is
+// stale, one reader collects the buffers and rebuilds it while the others
+// keep serving the old copy.
+inline std::shared_ptr<const std::string> leaderboardSnapshot() {
+    std::shared_ptr<const std::string> cached = std::atomic_load(&leaderboardJson);
+    if (cached && leaderboardClockMs() - leaderboardJsonAt.load(std::memory_order_acquire) < LEADERBOARD_REFRESH_MS)
+        return cached;
+
+    std::unique_lock<std::mutex> refresh(leaderboardRefreshLock, std::try_to_lock);
+    if (!refresh.owns_lock()) {
+        if (cached) return cached;
+        refresh.lock();
+        cached = std::atomic_load(&leaderboardJson);
+        if (cached && leaderboardClockMs() - leaderboardJsonAt.load(std::memory_order_acquire) < LEADERBOARD_REFRESH_MS)
+            return cached;
+    }
+
+    std::vector<LeaderboardEntry> pending, board;
+    uint64_t completed = 0;
+    {
+        std::lock_guard<std::mutex> guard(leaderboardLock);
+        for (auto& buffer : leaderboardBuffers) {
+            std::lock_guard<std::mutex> bufferGuard(buffer->lock);
+            pending.insert(pending.end(), buffer->entries.begin(), buffer->entries.end());
+            buffer->entries.clear();
+            completed += buffer->completed;
+        }
+    }
+    mergeLeaderboard(pending);
+    {
+        std::lock_guard<std::mutex> guard(leaderboardLock);
+        board = leaderboard;
+    }
+
+    auto json = std::make_shared<const std::string>(serializeLeaderboard(board, completed));
+    std::atomic_store(&leaderboardJson, json);
+    leaderboardJsonAt.store(leaderboardClockMs(), std::memory_order_release);
+    return json;
+}
+
+#endif
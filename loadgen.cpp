@@ -0,0 +1,435 @@
+// HTTP load generator for the treasure hunt server (Linux).
+//
+//   g++ -std=c++17 -O2 -pthread loadgen.cpp -o treasure_loadgen
+//   ./treasure_loadgen [--host 127.0.0.1] [--port 8080] [--connections 256]
+//                      [--threads 4] [--duration 10] [--warmup 1]
+//                      [--mix state,move,hint,reset,path]
+//
+// Every connection is one keep-alive player with its own session. It sends
+// one request at a time, walking the castle along real paths, and resets
+// its game when it runs out of moves. The mix gives relative weights of the
+// request kinds (default 50,30,5,5,10). At the end it prints throughput and
+// latency percentiles per request kind.
+
+#include <iostream>
+#include <string>
+#include <string_view>
+#include <vector>
+#include <unordered_map>
+#include <thread>
+#include <atomic>
+#include <chrono>
+#include <random>
+#include <algorithm>
+#include <iomanip>
+#include <cstring>
+#include <cstdlib>
+
+#ifndef __linux__
+    #error "loadgen.cpp uses epoll and only builds on Linux"
+#endif
+
+#include <sys/socket.h>
+#include <sys/epoll.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <cerrno>
+#include <csignal>
+
+using namespace std;
+using Clock = chrono::steady_clock;
+
+enum RequestKind { REQ_STATE, REQ_MOVE, REQ_HINT, REQ_RESET, REQ_PATH, REQ_KINDS };
+const char* const kindNames[REQ_KINDS] = { "state", "move", "hint", "reset", "path" };
+
+string host = "127.0.0.1";
+int port = 8080;
+int connectionCount = 256;
+int threadCount = 4;
+double durationSeconds = 10;
+double warmupSeconds = 1;
+int mixWeights[REQ_KINDS] = { 50, 30, 5, 5, 10 };
+
+// Castle layout learned from /api/state before the run
+vector<string> roomNames;
+vector<vector<int>> roomAdjacent;
+int entranceRoom = 0;
+
+struct KindStats {
+    vector<float> latencies;  // microseconds
+    long long errors = 0;
+};
+
+struct ThreadStats {
+    KindStats kinds[REQ_KINDS];
+    long long bytesIn = 0;
+    long long reconnects = 0;
+};
+
+struct Client {
+    int fd = -1;
+    string token;
+    int room = 0;
+    int moves = 0;
+    bool needReset = false;
+    RequestKind kind = REQ_STATE;
+    int pendingRoom = -1;
+    string out;
+    size_t outOffset = 0;
+    string in;
+    Clock::time_point sentAt;
+};
+
+int connectTo() {
+    int fd = socket(AF_INET, SOCK_STREAM, 0);
+    if (fd < 0) return -1;
+    sockaddr_in addr{};
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(port);
+    inet_pton(AF_INET, host.c_str(), &addr.sin_addr);
+    if (connect(fd, (sockaddr*)&addr, sizeof(addr)) != 0) {
+        close(fd);
+        return -1;
+    }
+    int one = 1;
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    return fd;
+}
+
+string randomToken(mt19937_64& rng) {
+    static const char hex[] = "0123456789abcdef";
+    string token(32, '0');
+    for (char& c : token) c = hex[rng() % 16];
+    return token;
+}
+
+// Splits a complete response off the front of buf. Returns its total size,
+// or 0 if more bytes are needed.
+size_t responseSize(const string& buf, int& status) {
+    size_t headEnd = buf.find("\r\n\r\n");
+    if (headEnd == string::npos) return 0;
+    status = buf.size() > 12 ? atoi(buf.c_str() + 9) : 0;
+
+    size_t bodyLength = 0;
+    string_view head(buf.data(), headEnd);
+    size_t pos = 0;
+    while (pos < head.size()) {
+        size_t lineEnd = head.find("\r\n", pos);
+        if (lineEnd == string_view::npos) lineEnd = head.size();
+        string_view line = head.substr(pos, lineEnd - pos);
+        if (line.size() > 15 && strncasecmp(line.data(), "Content-Length:", 15) == 0)
+            bodyLength = strtoul(string(line.substr(15)).c_str(), nullptr, 10);
+        pos = lineEnd + 2;
+    }
+    size_t total = headEnd + 4 + bodyLength;
+    return buf.size() >= total ? total : 0;
+}
+
+// Reads the quoted string starting at json[pos] (which must be '"')
+string readJsonString(string_view json, size_t& pos) {
+    string out;
+    for (pos++; pos < json.size() && json[pos] != '"'; pos++) {
+        if (json[pos] == '\\' && pos + 1 < json.size()) pos++;
+        out += json[pos];
+    }
+    pos++;
+    return out;
+}
+
+// Learns the room graph from one /api/state document
+bool loadCastleLayout() {
+    int fd = connectTo();
+    if (fd < 0) {
+        cerr << "Cannot connect to " << host << ":" << port << endl;
+        return false;
+    }
+    string request = "GET /api/state HTTP/1.1\r\nHost: " + host + "\r\nConnection: close\r\n\r\n";
+    send(fd, request.data(), request.size(), MSG_NOSIGNAL);
+    string response;
+    char buf[65536];
+    ssize_t n;
+    while ((n = recv(fd, buf, sizeof(buf), 0)) > 0) response.append(buf, n);
+    close(fd);
+
+    size_t bodyStart = response.find("\r\n\r\n");
+    if (bodyStart == string::npos) return false;
+    string_view json(response.data() + bodyStart + 4, response.size() - bodyStart - 4);
+
+    size_t current = json.find("\"currentRoom\":");
+    size_t roomsStart = json.find("\"rooms\":[");
+    if (current == string_view::npos || roomsStart == string_view::npos) return false;
+    current += 14;
+    string entranceName = readJsonString(json, current);
+
+    // Two passes: names first so adjacency can be stored as indices
+    vector<vector<string>> adjacentNames;
+    for (size_t pos = json.find("{\"name\":", roomsStart); pos != string_view::npos;
+         pos = json.find("{\"name\":", pos)) {
+        pos += 8;
+        roomNames.push_back(readJsonString(json, pos));
+        adjacentNames.emplace_back();
+        pos = json.find("\"adjacent\":[", pos) + 12;
+        while (pos < json.size() && json[pos] == '"') {
+            adjacentNames.back().push_back(readJsonString(json, pos));
+            if (json[pos] == ',') pos++;
+        }
+    }
+
+    unordered_map<string, int> index;
+    for (size_t i = 0; i < roomNames.size(); i++) index[roomNames[i]] = (int)i;
+    roomAdjacent.resize(roomNames.size());
+    for (size_t i = 0; i < roomNames.size(); i++)
+        for (auto& name : adjacentNames[i]) roomAdjacent[i].push_back(index[name]);
+    entranceRoom = index.count(entranceName) ? index[entranceName] : 0;
+    return !roomNames.empty();
+}
+
+RequestKind pickKind(mt19937_64& rng) {
+    int total = 0;
+    for (int w : mixWeights) total += w;
+    int r = (int)(rng() % max(1, total));
+    for (int k = 0; k < REQ_KINDS; k++) {
+        if (r < mixWeights[k]) return (RequestKind)k;
+        r -= mixWeights[k];
+    }
+    return REQ_STATE;
+}
+
+void buildRequest(Client& c, mt19937_64& rng) {
+    c.kind = c.needReset ? REQ_RESET : pickKind(rng);
+    if (c.kind == REQ_MOVE && roomAdjacent[c.room].empty()) c.kind = REQ_STATE;
+
+    string target;
+    switch (c.kind) {
+        case REQ_STATE: target = "/api/state?session=" + c.token; break;
+        case REQ_HINT:  target = "/api/hint?session=" + c.token; break;
+        case REQ_RESET: target = "/api/reset?session=" + c.token; break;
+        case REQ_MOVE: {
+            const vector<int>& adjacent = roomAdjacent[c.room];
+            c.pendingRoom = adjacent[rng() % adjacent.size()];
+            target = "/api/move?session=" + c.token + "&room=" + roomNames[c.pendingRoom];
+            break;
+        }
+        default:
+            target = "/api/path?session=" + c.token + "&start=" + roomNames[rng() % roomNames.size()]
+                   + "&end=" + roomNames[rng() % roomNames.size()];
+            break;
+    }
+    c.out = "GET " + target + " HTTP/1.1\r\nHost: " + host + "\r\n\r\n";
+    c.outOffset = 0;
+    c.sentAt = Clock::now();
+}
+
+// Updates the player's idea of its game from a response body
+void applyResponse(Client& c, string_view body) {
+    if (c.kind == REQ_RESET) {
+        c.room = entranceRoom;
+        c.moves = 0;
+        c.needReset = false;
+    } else if (c.kind == REQ_MOVE) {
+        if (body.find("\"success\":true") != string_view::npos) {
+            c.room = c.pendingRoom;
+            c.moves++;
+        } else {
+            c.needReset = true;  // out of moves or game won
+        }
+    }
+}
+
+bool flushClient(Client& c) {
+    while (c.outOffset < c.out.size()) {
+        ssize_t n = send(c.fd, c.out.data() + c.outOffset, c.out.size() - c.outOffset, MSG_NOSIGNAL);
+        if (n > 0) {
+            c.outOffset += n;
+        } else if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+            return true;
+        } else {
+            return false;
+        }
+    }
+    return true;
+}
+
+void runClients(int first, int count, Clock::time_point recordFrom, Clock::time_point stopAt, ThreadStats& stats) {
+    mt19937_64 rng(random_device{}() ^ ((uint64_t)first << 32));
+    int ep = epoll_create1(0);
+    vector<Client> clients(count);
+
+    auto openClient = [&](int i) {
+        Client& c = clients[i];
+        c.fd = connectTo();
+        if (c.fd < 0) return false;
+        fcntl(c.fd, F_SETFL, fcntl(c.fd, F_GETFL) | O_NONBLOCK);
+        epoll_event ev{};
+        ev.events = EPOLLIN | EPOLLOUT | EPOLLET;
+        ev.data.u32 = i;
+        epoll_ctl(ep, EPOLL_CTL_ADD, c.fd, &ev);
+        c.in.clear();
+        buildRequest(c, rng);
+        return flushClient(c);
+    };
+
+    for (int i = 0; i < count; i++) {
+        clients[i].token = randomToken(rng);
+        clients[i].room = entranceRoom;
+        if (!openClient(i)) {
+            cerr << "Cannot connect client " << first + i << endl;
+            return;
+        }
+    }
+
+    vector<epoll_event> events(256);
+    char buf[65536];
+    while (Clock::now() < stopAt) {
+        int n = epoll_wait(ep, events.data(), (int)events.size(), 100);
+        for (int e = 0; e < n; e++) {
+            Client& c = clients[events[e].data.u32];
+            bool ok = true;
+            if (events[e].events & EPOLLOUT) ok = flushClient(c);
+
+            while (ok && (events[e].events & (EPOLLIN | EPOLLHUP | EPOLLERR))) {
+                ssize_t got = recv(c.fd, buf, sizeof(buf), 0);
+                if (got > 0) {
+                    c.in.append(buf, got);
+                    stats.bytesIn += got;
+                } else {
+                    ok = got < 0 && (errno == EAGAIN || errno == EWOULDBLOCK);
+                    break;
+                }
+            }
+
+            int status = 0;
+            size_t size;
+            while (ok && (size = responseSize(c.in, status)) > 0) {
+                auto now = Clock::now();
+                KindStats& ks = stats.kinds[c.kind];
+                if (c.sentAt >= recordFrom) {
+                    ks.latencies.push_back(chrono::duration<float, micro>(now - c.sentAt).count());
+                    if (status != 200 && status != 304) ks.errors++;
+                }
+                size_t bodyStart = c.in.find("\r\n\r\n") + 4;
+                applyResponse(c, string_view(c.in).substr(bodyStart, size - bodyStart));
+                c.in.erase(0, size);
+                buildRequest(c, rng);
+                ok = flushClient(c);
+            }
+
+            if (!ok) {
+                // Server dropped the connection: count it against the request in flight
+                if (c.sentAt >= recordFrom) stats.kinds[c.kind].errors++;
+                epoll_ctl(ep, EPOLL_CTL_DEL, c.fd, nullptr);
+                close(c.fd);
+                stats.reconnects++;
+                if (!openClient(events[e].data.u32)) c.fd = -1;
+            }
+        }
+    }
+
+    for (Client& c : clients)
+        if (c.fd >= 0) close(c.fd);
+    close(ep);
+}
+
+double percentile(const vector<float>& sorted, double p) {
+    if (sorted.empty()) return 0;
+    size_t i = (size_t)(p * (sorted.size() - 1) + 0.5);
+    return sorted[min(i, sorted.size() - 1)];
+}
+
+void printRow(const string& name, vector<float>& latencies, long long errors, double seconds) {
+    sort(latencies.begin(), latencies.end());
+    cout << "  " << left << setw(8) << name << right << fixed << setprecision(1)
+         << setw(12) << latencies.size()
+         << setw(12) << latencies.size() / seconds
+         << setw(8) << errors
+         << setw(11) << percentile(latencies, 0.50)
+         << setw(11) << percentile(latencies, 0.99)
+         << setw(11) << percentile(latencies, 0.999)
+         << setw(11) << (latencies.empty() ? 0.0f : latencies.back()) << endl;
+}
+
+bool parseMix(const string& list) {
+    size_t pos = 0;
+    for (int k = 0; k < REQ_KINDS; k++) {
+        size_t comma = list.find(',', pos);
+        if ((comma == string::npos) != (k == REQ_KINDS - 1)) return false;
+        mixWeights[k] = max(0, atoi(list.substr(pos, comma - pos).c_str()));
+        pos = comma + 1;
+    }
+    return true;
+}
+
+int main(int argc, char* argv[]) {
+    for (int i = 1; i < argc; i++) {
+        string arg = argv[i];
+        bool hasValue = i + 1 < argc;
+        if (arg == "--host" && hasValue) {
+            host = argv[++i];
+        } else if (arg == "--port" && hasValue) {
+            port = atoi(argv[++i]);
+        } else if (arg == "--connections" && hasValue) {
+            connectionCount = max(1, atoi(argv[++i]));
+        } else if (arg == "--threads" && hasValue) {
+            threadCount = max(1, atoi(argv[++i]));
+        } else if (arg == "--duration" && hasValue) {
+            durationSeconds = max(0.1, atof(argv[++i]));
+        } else if (arg == "--warmup" && hasValue) {
+            warmupSeconds = max(0.0, atof(argv[++i]));
+        } else if (arg == "--mix" && hasValue && parseMix(argv[++i])) {
+        } else {
+            cerr << "Usage: " << argv[0] << " [--host H] [--port P] [--connections N] [--threads N]"
+                 << " [--duration S] [--warmup S] [--mix state,move,hint,reset,path]" << endl;
+            return 1;
+        }
+    }
+    signal(SIGPIPE, SIG_IGN);
+    threadCount = min(threadCount, connectionCount);
+
+    if (!loadCastleLayout()) {
+        cerr << "Cannot read the castle layout from /api/state" << endl;
+        return 1;
+    }
+    cout << "Castle has " << roomNames.size() << " rooms; " << connectionCount << " connections on "
+         << threadCount << " threads, " << warmupSeconds << " s warmup + " << durationSeconds << " s" << endl;
+
+    auto recordFrom = Clock::now() + chrono::duration_cast<Clock::duration>(chrono::duration<double>(warmupSeconds));
+    auto stopAt = recordFrom + chrono::duration_cast<Clock::duration>(chrono::duration<double>(durationSeconds));
+
+    vector<ThreadStats> stats(threadCount);
+    vector<thread> threads;
+    for (int t = 0, first = 0; t < threadCount; t++) {
+        int count = connectionCount / threadCount + (t < connectionCount % threadCount ? 1 : 0);
+        threads.emplace_back(runClients, first, count, recordFrom, stopAt, ref(stats[t]));
+        first += count;
+    }
+    for (auto& t : threads) t.join();
+
+    vector<float> all;
+    long long allErrors = 0, bytesIn = 0, reconnects = 0;
+    cout << "\n  " << left << setw(8) << "request" << right << setw(12) << "count" << setw(12) << "req/s"
+         << setw(8) << "errors" << setw(11) << "p50 us" << setw(11) << "p99 us" << setw(11) << "p999 us"
+         << setw(11) << "max us" << endl;
+    for (int k = 0; k < REQ_KINDS; k++) {
+        vector<float> latencies;
+        long long errors = 0;
+        for (auto& s : stats) {
+            latencies.insert(latencies.end(), s.kinds[k].latencies.begin(), s.kinds[k].latencies.end());
+            errors += s.kinds[k].errors;
+        }
+        all.insert(all.end(), latencies.begin(), latencies.end());
+        allErrors += errors;
+        printRow(kindNames[k], latencies, errors, durationSeconds);
+    }
+    printRow("all", all, allErrors, durationSeconds);
+
+    for (auto& s : stats) {
+        bytesIn += s.bytesIn;
+        reconnects += s.reconnects;
+    }
+    cout << "\n  received " << fixed << setprecision(1) << bytesIn / durationSeconds / 1e6 << " MB/s, "
+         << reconnects << " reconnects" << endl;
+    return 0;
+}
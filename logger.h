@@ -0,0 +1,187 @@
+// Asynchronous logger. Threads format a line straight into a slot of a
+// lock-free ring buffer and carry on; a background thread writes the lines
+// out in batches with one write and flush per batch. When the ring is full
+// lines are dropped and counted instead of blocking the caller.
+
+#ifndef LOGGER_H
+#define LOGGER_H
+
+#include <atomic>
+#include <cctype>
+#include <chrono>
+#include <cstdarg>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <ctime>
+#include <mutex>
+#include <string>
+#include <thread>
+
+enum LogLevel { LOG_DEBUG, LOG_INFO, LOG_WARN, LOG_ERROR, LOG_OFF };
+
+const char* const logLevelNames[] = { "DEBUG", "INFO", "WARN", "ERROR", "OFF" };
+
+const size_t LOG_RING_SLOTS = 4096;  // power of two
+const size_t LOG_LINE_MAX = 240;     // longer lines are truncated
+
+inline std::atomic<int> logLevel{LOG_INFO};
+inline std::atomic<unsigned> accessLogSample{1};  // log one request in N, 0 = off
+inline std::atomic<uint64_t> logLinesDropped{0};
+
+// Bounded multi-producer ring (Vyukov). A slot's sequence says whose turn
+// it is: == position when free for that producer, == position + 1 once
+// filled for the consumer.
+struct LogRing {
+    struct Slot {
+        std::atomic<uint64_t> sequence;
+        int64_t timeMs;
+        uint8_t level;
+        uint16_t length;
+        char text[LOG_LINE_MAX];
+    };
+
+    Slot slots[LOG_RING_SLOTS];
+    alignas(64) std::atomic<uint64_t> enqueuePos{0};
+    alignas(64) uint64_t dequeuePos = 0;  // writer thread only
+
+    LogRing() {
+        for (size_t i = 0; i < LOG_RING_SLOTS; i++) slots[i].sequence.store(i, std::memory_order_relaxed);
+    }
+
+    // Claims a free slot, or returns nullptr if the ring is full
+    Slot* claim(uint64_t& pos) {
+        pos = enqueuePos.load(std::memory_order_relaxed);
+        while (true) {
+            Slot& slot = slots[pos & (LOG_RING_SLOTS - 1)];
+            int64_t diff = (int64_t)slot.sequence.load(std::memory_order_acquire) - (int64_t)pos;
+            if (diff == 0) {
+                if (enqueuePos.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed)) return &slot;
+            } else if (diff < 0) {
+                return nullptr;
+            } else {
+                pos = enqueuePos.load(std::memory_order_relaxed);
+            }
+        }
+    }
+
+    void publish(Slot* slot, uint64_t pos) {
+        slot->sequence.store(pos + 1, std::memory_order_release);
+    }
+
+    Slot* next() {
+        Slot& slot = slots[dequeuePos & (LOG_RING_SLOTS - 1)];
+        if (slot.sequence.load(std::memory_order_acquire) != dequeuePos + 1) return nullptr;
+        return &slot;
+    }
+
+    void release(Slot* slot) {
+        slot->sequence.store(dequeuePos + LOG_RING_SLOTS, std::memory_order_release);
+        dequeuePos++;
+    }
+};
+
+inline LogRing logRing;
+
+inline void appendLogTimestamp(std::string& out, int64_t timeMs) {
+    time_t seconds = (time_t)(timeMs / 1000);
+    tm utc;
+#ifdef _WIN32
+    gmtime_s(&utc, &seconds);
+#else
+    gmtime_r(&seconds, &utc);
+#endif
+    char stamp[80];
+    snprintf(stamp, sizeof(stamp), "%04d-%02d-%02dT%02d:%02d:%02d.%03dZ", utc.tm_year + 1900, utc.tm_mon + 1,
+             utc.tm_mday, utc.tm_hour, utc.tm_min, utc.tm_sec, (int)(timeMs % 1000));
+    out += stamp;
+}
+
+// Drains the ring into stdout, one write per batch. Sleeps briefly when
+// there is nothing to do so producers never have to signal it.
+inline void runLogWriter() {
+    std::string batch;
+    uint64_t reportedDrops = 0;
+    while (true) {
+        batch.clear();
+        while (LogRing::Slot* slot = logRing.next()) {
+            appendLogTimestamp(batch, slot->timeMs);
+            batch += ' ';
+            batch += logLevelNames[slot->level];
+            batch += ' ';
+            batch.append(slot->text, slot->length);
+            batch += '\n';
+            logRing.release(slot);
+            if (batch.size() > 64 * 1024) break;
+        }
+
+        uint64_t drops = logLinesDropped.load(std::memory_order_relaxed);
+        if (drops != reportedDrops) {
+            appendLogTimestamp(batch, std::chrono::duration_cast<std::chrono::milliseconds>(
+                std::chrono::system_clock::now().time_since_epoch()).count());
+            batch += " WARN " + std::to_string(drops - reportedDrops) + " log lines dropped\n";
+            reportedDrops = drops;
+        }
+
+        if (batch.empty()) {
+            std::this_thread::sleep_for(std::chrono::milliseconds(2));
+        } else {
+            fwrite(batch.data(), 1, batch.size(), stdout);
+            fflush(stdout);
+        }
+    }
+}
+
+inline void startLogWriter() {
+    static std::once_flag started;
+    std::call_once(started, [] { std::thread(runLogWriter).detach(); });
+}
+
+inline bool logEnabled(LogLevel level) {
+    return level >= logLevel.load(std::memory_order_relaxed);
+}
+
+// printf-style. Formats into the ring; never blocks on I/O.
+inline void logMessage(LogLevel level, const char* format, ...) {
+    if (!logEnabled(level)) return;
+    startLogWriter();
+
+    uint64_t pos;
+    LogRing::Slot* slot = logRing.claim(pos);
+    if (!slot) {
+        logLinesDropped.fetch_add(1, std::memory_order_relaxed);
+        return;
+    }
+    va_list args;
+    va_start(args, format);
+    int length = vsnprintf(slot->text, LOG_LINE_MAX, format, args);
+    va_end(args);
+
+    slot->length = (uint16_t)(length < 0 ? 0 : length >= (int)LOG_LINE_MAX ? LOG_LINE_MAX - 1 : length);
+    slot->level = (uint8_t)level;
+    slot->timeMs = std::chrono::duration_cast<std::chrono::milliseconds>(
+        std::chrono::system_clock::now().time_since_epoch()).count();
+    logRing.publish(slot, pos);
+}
+
+// True for the requests picked by access log sampling on this thread
+inline bool sampleAccessLog() {
+    unsigned every = accessLogSample.load(std::memory_order_relaxed);
+    if (every == 0 || !logEnabled(LOG_INFO)) return false;
+    thread_local unsigned seen = 0;
+    return ++seen % every == 0;
+}
+
+inline bool parseLogLevel(const std::string& name, LogLevel& level) {
+    std::string upper;
+    for (char c : name) upper += (char)toupper((unsigned char)c);
+    for (int l = LOG_DEBUG; l <= LOG_OFF; l++) {
+        if (upper == logLevelNames[l]) {
+            level = (LogLevel)l;
+            return true;
+        }
+    }
+    return false;
+}
+
+#endif
@@ -1,443 +1,1709 @@
-#include <iostream>
-#include <string>
-#include <queue>
-#include <vector>
-#include <cstdlib>
-#include <ctime>
-#include <sstream>
-
-#ifdef _WIN32
-    #include <winsock2.h>
-    #include <ws2tcpip.h>
-    #pragma comment(lib, "ws2_32.lib")
-    typedef int socklen_t;
-#else
-    #include <sys/socket.h>
-    #include <netinet/in.h>
-    #include <unistd.h>
-    #include <arpa/inet.h>
-    #define SOCKET int
-    #define INVALID_SOCKET -1
-    #define SOCKET_ERROR -1
-    #define closesocket close
-#endif
-
-using namespace std;
-
-const int MAX_ROOMS = 20;
-const int PORT = 8080;
-
-// Game state
-int adj[MAX_ROOMS][MAX_ROOMS];
-string rooms[MAX_ROOMS];
-bool treasureInRoom[MAX_ROOMS];
-bool originalTreasure[MAX_ROOMS];
-int roomCount = 0;
-string currentRoom = "Entrance";
-int treasuresFound = 0;
-int moves = 0;
-int maxMoves = 8;
-bool hintUsed = false;
-
-int getRoomIndex(string name) {
-    for (int i = 0; i < roomCount; i++)
-        if (rooms[i] == name) return i;
-    return -1;
-}
-
-void addRoom(string name) {
-    rooms[roomCount] = name;
-    treasureInRoom[roomCount] = false;
-    originalTreasure[roomCount] = false;
-    roomCount++;
-}
-
-void addPath(string room1, string room2) {
-    int i = getRoomIndex(room1);
-    int j = getRoomIndex(room2);
-    if (i != -1 && j != -1) {
-        adj[i][j] = 1;
-        adj[j][i] = 1;
-    }
-}
-
-// BFS to find shortest path
-vector<string> findShortestPath(string start, string end) {
-    vector<string> path;
-    int startIdx = getRoomIndex(start);
-    int endIdx = getRoomIndex(end);
-    
-    if (startIdx == -1 || endIdx == -1) return path;
-    
-    // BFS
-    queue<int> q;
-    vector<bool> visited(roomCount, false);
-    vector<int> parent(roomCount, -1);
-    
-    q.push(startIdx);
-    visited[startIdx] = true;
-    
-    while (!q.empty()) {
-        int current = q.front();
-        q.pop();
-        
-        if (current == endIdx) break;
-        
-        for (int i = 0; i < roomCount; i++) {
-            if (adj[current][i] && !visited[i]) {
-                visited[i] = true;
-                parent[i] = current;
-                q.push(i);
-            }
-        }
-    }
-    
-    // Reconstruct path
-    if (visited[endIdx]) {
-        int current = endIdx;
-        while (current != -1) {
-            path.insert(path.begin(), rooms[current]);
-            current = parent[current];
-        }
-    }
-    
-    return path;
-}
-
-string getHint() {
-    if (hintUsed) {
-        return "Out of hints! You've already used your one hint for this quest.";
-    }
-    
-    for (int i = 0; i < roomCount; i++) {
-        if (treasureInRoom[i]) {
-            hintUsed = true;
-            
-            if (rooms[i] == "Armory") return "The treasure lies where weapons rest in silence.";
-            if (rooms[i] == "TreasureRoom") return "The treasure lies where riches are locked away.";
-            if (rooms[i] == "Dungeon") return "The treasure lies deep underground, cold and dark.";
-            if (rooms[i] == "Library") return "The treasure lies where knowledge rests and dust gathers.";
-            if (rooms[i] == "Kitchen") return "The treasure lies where food fills the air with warmth.";
-            if (rooms[i] == "Garden") return "The treasure lies where flowers bloom and secrets grow.";
-            if (rooms[i] == "Observatory") return "The treasure lies where stars are watched at night.";
-            if (rooms[i] == "Hall") return "The treasure lies where footsteps echo endlessly.";
-            if (rooms[i] == "Balcony") return "The treasure lies where winds whisper tales.";
-            
-            return "A treasure awaits in " + rooms[i] + "...";
-        }
-    }
-    
-    return "No treasures remain to find!";
-}
-
-vector<string> getAdjacentRooms(string room) {
-    vector<string> adjacent;
-    int idx = getRoomIndex(room);
-    if (idx == -1) return adjacent;
-    
-    for (int i = 0; i < roomCount; i++) {
-        if (adj[idx][i]) {
-            adjacent.push_back(rooms[i]);
-        }
-    }
-    return adjacent;
-}
-
-string movePlayer(string targetRoom) {
-    if (treasuresFound >= 3) {
-        return "ERROR:Game already won";
-    }
-    if (moves >= maxMoves) {
-        return "ERROR:Out of moves";
-    }
-    
-    int currentIdx = getRoomIndex(currentRoom);
-    int targetIdx = getRoomIndex(targetRoom);
-    
-    if (targetIdx == -1) {
-        return "ERROR:Room not found";
-    }
-    
-    if (!adj[currentIdx][targetIdx]) {
-        return "ERROR:Rooms are not connected";
-    }
-    
-    currentRoom = targetRoom;
-    moves++;
-    
-    if (treasureInRoom[targetIdx]) {
-        treasureInRoom[targetIdx] = false;
-        treasuresFound++;
-        return "TREASURE:Found treasure in " + targetRoom;
-    }
-    
-    return "SUCCESS:Moved to " + targetRoom;
-}
-
-void resetGame() {
-    currentRoom = "Entrance";
-    treasuresFound = 0;
-    moves = 0;
-    hintUsed = false;
-    
-    for (int i = 0; i < roomCount; i++) {
-        treasureInRoom[i] = false;
-        originalTreasure[i] = false;
-    }
-    
-    int totalTreasures = 3;
-    int assigned = 0;
-    
-    while (assigned < totalTreasures) {
-        int r = rand() % roomCount;
-        
-        if (rooms[r] != "Entrance" && !treasureInRoom[r]) {
-            treasureInRoom[r] = true;
-            originalTreasure[r] = true;
-            assigned++;
-            cout << "Treasure placed in: " << rooms[r] << endl;
-        }
-    }
-}
-
-string getGameState() {
-    stringstream ss;
-    ss << "{";
-    ss << "\"currentRoom\":\"" << currentRoom << "\",";
-    ss << "\"treasuresFound\":" << treasuresFound << ",";
-    ss << "\"moves\":" << moves << ",";
-    ss << "\"maxMoves\":" << maxMoves << ",";
-    ss << "\"hintUsed\":" << (hintUsed ? "true" : "false") << ",";
-    ss << "\"gameOver\":" << ((treasuresFound >= 3 || moves >= maxMoves) ? "true" : "false") << ",";
-    ss << "\"won\":" << ((treasuresFound >= 3 && moves <= maxMoves) ? "true" : "false") << ",";
-    ss << "\"treasureLocations\":[";
-    
-    bool first = true;
-    for (int i = 0; i < roomCount; i++) {
-        if (originalTreasure[i]) {
-            if (!first) ss << ",";
-            ss << "\"" << rooms[i] << "\"";
-            first = false;
-        }
-    }
-    ss << "],";
-    
-    ss << "\"rooms\":[";
-    
-    for (int i = 0; i < roomCount; i++) {
-        if (i > 0) ss << ",";
-        ss << "{\"name\":\"" << rooms[i] << "\",";
-        ss << "\"hasTreasure\":" << (treasureInRoom[i] ? "true" : "false") << ",";
-        ss << "\"adjacent\":[";
-        
-        vector<string> adj = getAdjacentRooms(rooms[i]);
-        for (size_t j = 0; j < adj.size(); j++) {
-            if (j > 0) ss << ",";
-            ss << "\"" << adj[j] << "\"";
-        }
-        ss << "]}";
-    }
-    ss << "]}";
-    return ss.str();
-}
-
-void initializeGame() {
-    srand(time(0));
-    
-    for (int i = 0; i < MAX_ROOMS; i++)
-        for (int j = 0; j < MAX_ROOMS; j++)
-            adj[i][j] = 0;
-
-    addRoom("Entrance");
-    addRoom("Hall");
-    addRoom("Armory");
-    addRoom("TreasureRoom");
-    addRoom("Library");
-    addRoom("Kitchen");
-    addRoom("Dungeon");
-    addRoom("Observatory");
-    addRoom("Garden");
-    addRoom("Balcony");
-
-    addPath("Entrance", "Hall");
-    addPath("Entrance", "Library");
-    addPath("Hall", "Armory");
-    addPath("Hall", "Library");
-    addPath("Hall", "Dungeon");
-    addPath("Library", "Kitchen");
-    addPath("Library", "Armory");
-    addPath("Library", "Observatory");
-    addPath("Armory", "TreasureRoom");
-    addPath("Kitchen", "TreasureRoom");
-    addPath("Kitchen", "Dungeon");
-    addPath("Kitchen", "Garden");
-    addPath("Observatory", "Balcony");
-    addPath("Garden", "Balcony");
-
-    cout << "Castle initialized with " << roomCount << " rooms" << endl;
-    resetGame();
-}
-
-string handleRequest(string request) {
-    if (request.find("OPTIONS") == 0) {
-        return "OPTIONS";
-    }
-    
-    if (request.find("GET /api/state") != string::npos) {
-        return getGameState();
-    }
-    else if (request.find("GET /api/move?room=") != string::npos) {
-        size_t pos = request.find("room=");
-        if (pos != string::npos) {
-            size_t end = request.find(" ", pos);
-            if (end == string::npos) end = request.find("&", pos);
-            if (end == string::npos) end = request.length();
-            
-            string room = request.substr(pos + 5, end - pos - 5);
-            
-            size_t spacePos;
-            while ((spacePos = room.find("%20")) != string::npos) {
-                room.replace(spacePos, 3, " ");
-            }
-            
-            string result = movePlayer(room);
-            
-            stringstream ss;
-            ss << "{\"success\":" << (result.find("SUCCESS") != string::npos || result.find("TREASURE") != string::npos ? "true" : "false") << ",";
-            ss << "\"message\":\"" << result << "\",";
-            ss << "\"foundTreasure\":" << (result.find("TREASURE") != string::npos ? "true" : "false") << "}";
-            return ss.str();
-        }
-    }
-    else if (request.find("GET /api/hint") != string::npos) {
-        string hint = getHint();
-        return "{\"hint\":\"" + hint + "\",\"used\":" + (hintUsed ? "true" : "false") + "}";
-    }
-    else if (request.find("GET /api/reset") != string::npos) {
-        resetGame();
-        return "{\"success\":true,\"message\":\"Game reset\"}";
-    }
-    else if (request.find("GET /api/path?") != string::npos) {
-        size_t startPos = request.find("start=");
-        size_t endPos = request.find("end=");
-        
-        if (startPos != string::npos && endPos != string::npos) {
-            size_t startEnd = request.find("&", startPos);
-            size_t endEnd = request.find(" ", endPos);
-            if (endEnd == string::npos) endEnd = request.find("&", endPos);
-            if (endEnd == string::npos) endEnd = request.length();
-            
-            string startRoom = request.substr(startPos + 6, startEnd - startPos - 6);
-            string endRoom = request.substr(endPos + 4, endEnd - endPos - 4);
-            
-            vector<string> path = findShortestPath(startRoom, endRoom);
-            
-            stringstream ss;
-            ss << "{\"path\":[";
-            for (size_t i = 0; i < path.size(); i++) {
-                if (i > 0) ss << ",";
-                ss << "\"" << path[i] << "\"";
-            }
-            ss << "]}";
-            return ss.str();
-        }
-    }
-    
-    return "{\"error\":\"Unknown endpoint\"}";
-}
-
-int main() {
-    cout << "=== C++ Treasure Hunt Server ===" << endl;
-    cout << "==================================" << endl;
-    
-    #ifdef _WIN32
-    WSADATA wsaData;
-    if (WSAStartup(MAKEWORD(2, 2), &wsaData) != 0) {
-        cerr << "WSAStartup failed" << endl;
-        return 1;
-    }
-    #endif
-    
-    initializeGame();
-    
-    SOCKET serverSocket = socket(AF_INET, SOCK_STREAM, 0);
-    if (serverSocket == INVALID_SOCKET) {
-        cerr << "Socket creation failed" << endl;
-        return 1;
-    }
-    
-    int opt = 1;
-    setsockopt(serverSocket, SOL_SOCKET, SO_REUSEADDR, (char*)&opt, sizeof(opt));
-    
-    sockaddr_in serverAddr;
-    serverAddr.sin_family = AF_INET;
-    serverAddr.sin_addr.s_addr = INADDR_ANY;
-    serverAddr.sin_port = htons(PORT);
-    
-    if (bind(serverSocket, (sockaddr*)&serverAddr, sizeof(serverAddr)) == SOCKET_ERROR) {
-        cerr << "Bind failed" << endl;
-        closesocket(serverSocket);
-        return 1;
-    }
-    
-    if (listen(serverSocket, 5) == SOCKET_ERROR) {
-        cerr << "Listen failed" << endl;
-        closesocket(serverSocket);
-        return 1;
-    }
-    
-    cout << "\n?? Server running on http://localhost:" << PORT << endl;
-    cout << "?? Open index.html in your browser to play!" << endl;
-    cout << "?? Press Ctrl+C to stop server\n" << endl;
-    cout << "Waiting for connections...\n" << endl;
-    
-    while (true) {
-        sockaddr_in clientAddr;
-        socklen_t clientLen = sizeof(clientAddr);
-        SOCKET clientSocket = accept(serverSocket, (sockaddr*)&clientAddr, &clientLen);
-        
-        if (clientSocket == INVALID_SOCKET) continue;
-        
-        char buffer[4096] = {0};
-        recv(clientSocket, buffer, sizeof(buffer), 0);
-        string request(buffer);
-        
-        string requestLine = request.substr(0, request.find("\r\n"));
-        cout << "?? " << requestLine << endl;
-        
-        string response = handleRequest(request);
-        
-        stringstream httpResponse;
-        
-        if (response == "OPTIONS") {
-            httpResponse << "HTTP/1.1 204 No Content\r\n";
-            httpResponse << "Access-Control-Allow-Origin: *\r\n";
-            httpResponse << "Access-Control-Allow-Methods: GET, POST, OPTIONS\r\n";
-            httpResponse << "Access-Control-Allow-Headers: Content-Type\r\n";
-            httpResponse << "Access-Control-Max-Age: 86400\r\n";
-            httpResponse << "\r\n";
-        } else {
-            httpResponse << "HTTP/1.1 200 OK\r\n";
-            httpResponse << "Content-Type: application/json\r\n";
-            httpResponse << "Access-Control-Allow-Origin: *\r\n";
-            httpResponse << "Access-Control-Allow-Methods: GET, POST, OPTIONS\r\n";
-            httpResponse << "Access-Control-Allow-Headers: Content-Type\r\n";
-            httpResponse << "Content-Length: " << response.length() << "\r\n";
-            httpResponse << "\r\n";
-            httpResponse << response;
-        }
-        
-        string fullResponse = httpResponse.str();
-        send(clientSocket, fullResponse.c_str(), fullResponse.length(), 0);
-        
-        closesocket(clientSocket);
-    }
-    
-    closesocket(serverSocket);
-    
-    #ifdef _WIN32
-    WSACleanup();
-    #endif
-    
-    return 0;
-}
+#include <iostream>
+#include <string>
+#include <cstdint>
+#include <string_view>
+#include <vector>
+#include <cstdlib>
+#include <ctime>
+#include <map>
+#include <cctype>
+#include <unordered_map>
+#include <memory>
+#include <mutex>
+#include <random>
+#include <thread>
+#include <condition_variable>
+#include <functional>
+#include <deque>
+#include <algorithm>
+#include <atomic>
+
+#ifdef _WIN32
+    #define FD_SETSIZE 1024
+    #include <winsock2.h>
+    #include <ws2tcpip.h>
+    #pragma comment(lib, "ws2_32.lib")
+    typedef int socklen_t;
+    #define MSG_NOSIGNAL 0
+#else
+    #include <sys/socket.h>
+    #include <sys/uio.h>
+    #include <netinet/in.h>
+    #include <netinet/tcp.h>
+    #include <unistd.h>
+    #include <arpa/inet.h>
+    #include <fcntl.h>
+    #include <cerrno>
+    #include <csignal>
+    #define SOCKET int
+    #define INVALID_SOCKET -1
+    #define SOCKET_ERROR -1
+    #define closesocket close
+    #ifdef __linux__
+        #include <sys/epoll.h>
+        #include <sys/eventfd.h>
+    #endif
+#endif
+
+#include <zlib.h>
+#include <brotli/encode.h>
+
+#include "admission.h"
+#include "journal.h"
+#include "leaderboard.h"
+
+using namespace std;
+
+const int PORT = 8080;
+const size_t MAX_REQUEST_SIZE = 64 * 1024;
+const size_t MAX_QUEUED_OUTPUT = 4 * 1024 * 1024;  // unsent reply bytes before a connection stops taking requests
+const int KEEP_ALIVE_TIMEOUT = 60;  // seconds
+const int SESSION_SHARDS = 64;
+const int SESSION_IDLE_TIMEOUT = 30 * 60;  // seconds
+const int SESSION_EXTRAS_IDLE = 60;        // seconds before an idle game drops its cached state
+const int LONG_POLL_TIMEOUT = 25;          // seconds
+const int MAX_HEADERS = 32;
+const int MAX_BATCH_MOVES = 64;
+
+int listenBacklog = SOMAXCONN;
+int workerThreads = max(1u, thread::hardware_concurrency());
+string mapFile;  // castle map to load, empty for the built-in map
+string dataDir;  // where games are saved, empty to keep them in memory only
+int snapshotInterval = 60;  // seconds between snapshots of every game
+string webRoot = ".";  // directory holding the frontend files
+
+struct HttpResponse {
+    int status = 200;
+    const char* contentType = nullptr;  // default application/json
+    string body;
+    shared_ptr<const string> sharedBody;  // used instead of body when set, e.g. a cached document
+    string headers;         // extra header lines, each ending in \r\n
+    bool deferred = false;  // will be answered later through the reply callback
+};
+
+typedef function<void(HttpResponse)> ReplyFn;
+
+// A long-poll request parked until its game changes or it times out.
+// Whoever flips `answered` first sends the reply.
+struct StateWaiter {
+    atomic<bool> answered{false};
+    ReplyFn reply;
+    string etag;
+    time_t deadline = 0;
+};
+
+// Sessions are spread over independently locked shards keyed by token
+// hash. Each shard allocates its sessions from its own slab pool and
+// indexes them by a view of the token stored in the session.
+struct SessionShard {
+    mutex lock;
+    SlabPool<GameSession> pool;
+    unordered_map<string_view, GameSession*> sessions;
+};
+
+SessionShard sessionShards[SESSION_SHARDS];
+
+// Parked long-polls in deadline order
+mutex waiterLock;
+deque<shared_ptr<StateWaiter>> pendingWaits;
+
+bool initializeGame() {
+    string error;
+    if (!loadGameMap(mapFile, error)) {
+        cerr << "Cannot load castle map: " << error << endl;
+        return false;
+    }
+    cout << "Castle initialized with " << castle.roomCount << " rooms" << endl;
+    return true;
+}
+
+// A parsed HTTP request. Every field is a view into the raw request bytes,
+// which must outlive it.
+struct HttpRequest {
+    string_view method;
+    string_view target;
+    string_view path;
+    string_view query;
+    string_view version;
+    string_view body;
+    string_view headerNames[MAX_HEADERS];
+    string_view headerValues[MAX_HEADERS];
+    int headerCount = 0;
+    
+    string_view header(string_view name) const;
+    bool keepAlive() const;
+};
+
+bool equalsIgnoreCase(string_view a, string_view b) {
+    if (a.size() != b.size()) return false;
+    for (size_t i = 0; i < a.size(); i++)
+        if (tolower((unsigned char)a[i]) != tolower((unsigned char)b[i])) return false;
+    return true;
+}
+
+string_view HttpRequest::header(string_view name) const {
+    for (int i = 0; i < headerCount; i++)
+        if (equalsIgnoreCase(headerNames[i], name)) return headerValues[i];
+    return string_view();
+}
+
+// HTTP/1.1 defaults to persistent connections, HTTP/1.0 has to ask
+bool HttpRequest::keepAlive() const {
+    string_view connection = header("Connection");
+    if (version == "HTTP/1.1") return !equalsIgnoreCase(connection, "close");
+    return equalsIgnoreCase(connection, "keep-alive");
+}
+
+// Parses the request line and headers of head, which ends just before the
+// blank line, in a single pass. Returns false if the request is malformed.
+bool parseHttpHead(string_view head, HttpRequest& req) {
+    size_t lineEnd = head.find("\r\n");
+    string_view line = head.substr(0, lineEnd);
+    
+    size_t methodEnd = line.find(' ');
+    size_t targetEnd = methodEnd == string_view::npos ? methodEnd : line.find(' ', methodEnd + 1);
+    if (methodEnd == 0 || targetEnd == string_view::npos || targetEnd == methodEnd + 1) return false;
+    
+    req.method = line.substr(0, methodEnd);
+    req.target = line.substr(methodEnd + 1, targetEnd - methodEnd - 1);
+    req.version = line.substr(targetEnd + 1);
+    if (req.version.substr(0, 7) != "HTTP/1.") return false;
+    
+    size_t queryStart = req.target.find('?');
+    req.path = req.target.substr(0, queryStart);
+    req.query = queryStart == string_view::npos ? string_view() : req.target.substr(queryStart + 1);
+    
+    req.headerCount = 0;
+    while (lineEnd != string_view::npos) {
+        size_t start = lineEnd + 2;
+        lineEnd = head.find("\r\n", start);
+        line = head.substr(start, lineEnd == string_view::npos ? string_view::npos : lineEnd - start);
+        
+        size_t colon = line.find(':');
+        if (colon == string_view::npos || colon == 0 || req.headerCount == MAX_HEADERS) return false;
+        
+        string_view value = line.substr(colon + 1);
+        while (!value.empty() && (value.front() == ' ' || value.front() == '\t')) value.remove_prefix(1);
+        while (!value.empty() && (value.back() == ' ' || value.back() == '\t')) value.remove_suffix(1);
+        req.headerNames[req.headerCount] = line.substr(0, colon);
+        req.headerValues[req.headerCount] = value;
+        req.headerCount++;
+    }
+    return true;
+}
+
+// Returns false if the value is not a plain decimal number
+bool parseDecimal(string_view text, size_t& value) {
+    if (text.empty() || text.size() > 18) return false;
+    value = 0;
+    for (char c : text) {
+        if (c < '0' || c > '9') return false;
+        value = value * 10 + (c - '0');
+    }
+    return true;
+}
+
+int hexValue(char c) {
+    if (c >= '0' && c <= '9') return c - '0';
+    if (c >= 'a' && c <= 'f') return c - 'a' + 10;
+    if (c >= 'A' && c <= 'F') return c - 'A' + 10;
+    return -1;
+}
+
+// Decodes %XX escapes and '+' (form encoding for a space) into out
+void percentDecode(string_view in, string& out) {
+    out.clear();
+    for (size_t i = 0; i < in.size(); i++) {
+        if (in[i] == '%' && i + 2 < in.size() && hexValue(in[i + 1]) >= 0 && hexValue(in[i + 2]) >= 0) {
+            out += (char)(hexValue(in[i + 1]) * 16 + hexValue(in[i + 2]));
+            i += 2;
+        } else {
+            out += in[i] == '+' ? ' ' : in[i];
+        }
+    }
+}
+
+// Raw (still encoded) value of a query or form parameter
+bool findParam(string_view query, string_view name, string_view& value) {
+    while (!query.empty()) {
+        size_t end = query.find('&');
+        string_view pair = query.substr(0, end);
+        if (pair.size() > name.size() && pair[name.size()] == '=' && pair.substr(0, name.size()) == name) {
+            value = pair.substr(name.size() + 1);
+            return true;
+        }
+        if (end == string_view::npos) break;
+        query.remove_prefix(end + 1);
+    }
+    return false;
+}
+
+// Decoded query parameter; out is reused by callers so it rarely allocates
+bool getQueryParam(const HttpRequest& req, string_view name, string& out) {
+    string_view raw;
+    if (!findParam(req.query, name, raw)) return false;
+    percentDecode(raw, out);
+    return true;
+}
+
+string_view getCookie(string_view cookies, string_view name) {
+    while (!cookies.empty()) {
+        while (!cookies.empty() && (cookies.front() == ' ' || cookies.front() == ';')) cookies.remove_prefix(1);
+        size_t end = cookies.find(';');
+        string_view cookie = cookies.substr(0, end);
+        if (cookie.size() > name.size() && cookie[name.size()] == '=' && cookie.substr(0, name.size()) == name)
+            return cookie.substr(name.size() + 1);
+        if (end == string_view::npos) break;
+        cookies.remove_prefix(end);
+    }
+    return string_view();
+}
+
+SessionShard& shardFor(string_view token) {
+    return sessionShards[hash<string_view>()(token) % SESSION_SHARDS];
+}
+
+string newSessionToken() {
+    static thread_local mt19937_64 rng(random_device{}());
+    static const char* digits = "0123456789abcdef";
+    string token(32, '0');
+    for (int i = 0; i < 32; i += 16) {
+        unsigned long long bits = rng();
+        for (int j = 0; j < 16; j++, bits >>= 4) token[i + j] = digits[bits & 15];
+    }
+    return token;
+}
+
+bool isValidToken(string_view token) {
+    if (token.size() != 32) return false;
+    for (char c : token)
+        if (!isxdigit((unsigned char)c)) return false;
+    return true;
+}
+
+// Returns the session for a token, starting a new game if the token is
+// unknown (e.g. it expired or the server restarted) or missing. A new
+// game's journal record is returned in journalSeq.
+GameSession* getOrCreateSession(string_view requested, bool& created, uint64_t& journalSeq) {
+    created = false;
+    journalSeq = 0;
+    uint32_t now = (uint32_t)time(0);
+    string token;
+    if (isValidToken(requested)) {
+        SessionShard& shard = shardFor(requested);
+        lock_guard<mutex> guard(shard.lock);
+        auto it = shard.sessions.find(requested);
+        if (it != shard.sessions.end()) {
+            it->second->lastActive = now;
+            return it->second;
+        }
+        token = requested;
+    } else {
+        token = newSessionToken();
+    }
+    
+    // The game is set up outside the shard lock, since placing treasures
+    // can take a while on big maps
+    SessionShard& shard = shardFor(token);
+    GameSession* session;
+    {
+        lock_guard<mutex> guard(shard.lock);
+        session = shard.pool.create();
+    }
+    memcpy(session->token, token.data(), SESSION_TOKEN_LENGTH);
+    session->lastActive = now;
+    resetGame(*session);
+    
+    lock_guard<mutex> guard(shard.lock);
+    auto inserted = shard.sessions.emplace(session->tokenView(), session);
+    // Journaled before anyone else can find the game, so its reset comes first
+    created = inserted.second;
+    if (created) journalSeq = journalReset(*session);
+    else shard.pool.destroy(session);
+    return inserted.first->second;
+}
+
+// Expires idle sessions one shard per call, so a full pass is spread out
+// instead of stalling the server while every session is visited.
+void sweepIdleSessions(time_t now) {
+    static int nextShard = 0;
+    SessionShard& shard = sessionShards[nextShard];
+    nextShard = (nextShard + 1) % SESSION_SHARDS;
+    
+    // A session in use is never idle, since lookups refresh lastActive under
+    // the shard lock; try_lock only skips the rare request still finishing
+    lock_guard<mutex> guard(shard.lock);
+    for (auto it = shard.sessions.begin(); it != shard.sessions.end();) {
+        GameSession* session = it->second;
+        uint32_t idle = (uint32_t)now - session->lastActive;
+        if (idle > SESSION_EXTRAS_IDLE && session->lock.try_lock()) {
+            if (idle > SESSION_IDLE_TIMEOUT) {
+                it = shard.sessions.erase(it);
+                session->lock.unlock();
+                shard.pool.destroy(session);
+                continue;
+            }
+            session->extras.reset();
+            session->lock.unlock();
+        }
+        ++it;
+    }
+}
+
+// Calls fn on every session, holding its shard and session locks
+void forEachSession(const function<void(GameSession&)>& fn) {
+    for (SessionShard& shard : sessionShards) {
+        lock_guard<mutex> guard(shard.lock);
+        for (auto& entry : shard.sessions) {
+            lock_guard<SessionLock> sessionGuard(entry.second->lock);
+            fn(*entry.second);
+        }
+    }
+}
+
+// Adds a saved game while the journal is replayed at startup
+GameSession* findSavedSession(string_view token, bool create) {
+    SessionShard& shard = shardFor(token);
+    auto it = shard.sessions.find(token);
+    if (it != shard.sessions.end() || !create) return it != shard.sessions.end() ? it->second : nullptr;
+    
+    GameSession* session = shard.pool.create();
+    memcpy(session->token, token.data(), min<size_t>(token.size(), SESSION_TOKEN_LENGTH));
+    session->lastActive = (uint32_t)time(0);
+    session->startedAt = session->lastActive;  // not saved; the clock restarts with the server
+    shard.sessions.emplace(session->tokenView(), session);
+    return session;
+}
+
+// Loads the games saved in dataDir, then keeps snapshotting them in the
+// background. The first snapshot folds the replayed journal away.
+bool restoreGames() {
+    if (dataDir.empty()) return true;
+    
+    string error;
+    if (!openJournal(dataDir, findSavedSession, error)) {
+        cerr << "Cannot load saved games: " << error << endl;
+        return false;
+    }
+    size_t restored = 0;
+    for (SessionShard& shard : sessionShards) restored += shard.sessions.size();
+    cout << "Restored " << restored << " saved games from " << dataDir << endl;
+    
+    takeSnapshot(forEachSession);
+    thread([] {
+        while (true) {
+            this_thread::sleep_for(chrono::seconds(snapshotInterval));
+            takeSnapshot(forEachSession);
+        }
+    }).detach();
+    return true;
+}
+
+// Identifies this server run, so ETags from before a restart never match
+const string& serverInstance() {
+    static const string id = newSessionToken().substr(0, 8);
+    return id;
+}
+
+string stateEtag(const GameSession& session) {
+    return "\"" + serverInstance() + "-" + to_string(session.version) + "\"";
+}
+
+HttpResponse stateResponse(GameSession& session) {
+    HttpResponse response;
+    response.sharedBody = getGameState(session);
+    response.headers = "ETag: " + stateEtag(session) + "\r\nCache-Control: no-cache\r\n";
+    return response;
+}
+
+HttpResponse notModified(const string& etag) {
+    HttpResponse response;
+    response.status = 304;
+    response.headers = "ETag: " + etag + "\r\nCache-Control: no-cache\r\n";
+    return response;
+}
+
+// Answers every long-poll parked on a game that has just changed.
+// Called with the session lock held.
+void notifyStateWaiters(GameSession& session) {
+    if (!session.extras || session.extras->waiters.empty()) return;
+    HttpResponse response = stateResponse(session);
+    for (auto& waiter : session.extras->waiters) {
+        if (!waiter->answered.exchange(true)) waiter->reply(response);
+    }
+    session.extras->waiters.clear();
+}
+
+// Answers long-polls whose deadline has passed with 304 Not Modified
+void expireStateWaiters(time_t now) {
+    vector<shared_ptr<StateWaiter>> expired;
+    {
+        lock_guard<mutex> guard(waiterLock);
+        while (!pendingWaits.empty() && pendingWaits.front()->deadline <= now) {
+            expired.push_back(pendingWaits.front());
+            pendingWaits.pop_front();
+        }
+    }
+    for (auto& waiter : expired) {
+        if (!waiter->answered.exchange(true)) waiter->reply(notModified(waiter->etag));
+    }
+}
+
+struct RequestContext {
+    const HttpRequest& request;
+    GameSession& session;
+    const ReplyFn& reply;
+    uint64_t journalSeq;  // last journal record the reply must wait for, 0 if none
+};
+
+typedef HttpResponse (*Endpoint)(RequestContext& ctx);
+
+HttpResponse stateEndpoint(RequestContext& ctx) {
+    string etag = stateEtag(ctx.session);
+    if (ctx.request.header("If-None-Match").find(etag) != string_view::npos) {
+        return notModified(etag);
+    }
+    return stateResponse(ctx.session);
+}
+
+// Long-poll: answer as soon as the game moves past the client's version
+HttpResponse waitEndpoint(RequestContext& ctx) {
+    GameSession& session = ctx.session;
+    string_view known;
+    size_t knownVersion;
+    if (!findParam(ctx.request.query, "version", known) || !parseDecimal(known, knownVersion)
+        || knownVersion != session.version) {
+        return stateResponse(session);
+    }
+    
+    auto waiter = make_shared<StateWaiter>();
+    waiter->reply = ctx.reply;
+    waiter->etag = stateEtag(session);
+    waiter->deadline = time(0) + LONG_POLL_TIMEOUT;
+    vector<shared_ptr<StateWaiter>>& waiters = session.extra().waiters;
+    waiters.erase(remove_if(waiters.begin(), waiters.end(),
+                            [](const shared_ptr<StateWaiter>& w) { return w->answered.load(); }),
+                  waiters.end());
+    waiters.push_back(waiter);
+    {
+        lock_guard<mutex> waitGuard(waiterLock);
+        pendingWaits.push_back(waiter);
+    }
+    HttpResponse response;
+    response.deferred = true;
+    return response;
+}
+
+// Wins are recorded here rather than in movePlayer, so replaying the
+// journal at startup does not enter the same games twice
+void recordIfWon(const GameSession& session) {
+    if (session.treasuresFound() >= session.treasureCount) recordCompletedGame(session);
+}
+
+HttpResponse moveEndpoint(RequestContext& ctx) {
+    static thread_local string room;
+    if (!getQueryParam(ctx.request, "room", room)) room.clear();
+    
+    MoveResult result = movePlayer(ctx.session, getRoomIndex(room));
+    bool success = result == MOVE_OK || result == MOVE_TREASURE;
+    if (success) ctx.journalSeq = journalMove(ctx.session);
+    if (result == MOVE_TREASURE) recordIfWon(ctx.session);
+    
+    HttpResponse response;
+    response.body = "{\"success\":";
+    response.body += success ? "true" : "false";
+    response.body += ",\"message\":\"";
+    response.body += moveMessage(result, room);
+    response.body += "\",\"foundTreasure\":";
+    response.body += result == MOVE_TREASURE ? "true" : "false";
+    response.body += "}";
+    return response;
+}
+
+// Several moves (optionally after a hint) in one request, applied in order
+// under the session lock: ?moves=Hall,Library[&hint=1]. Stops at the first
+// move that fails and returns every step's result plus the final state.
+HttpResponse batchEndpoint(RequestContext& ctx) {
+    GameSession& session = ctx.session;
+    static thread_local string moves, flag;
+    HttpResponse response;
+    response.body = "{";
+    
+    if (getQueryParam(ctx.request, "hint", flag) && (flag == "1" || flag == "true")) {
+        unsigned versionBefore = session.version;
+        string hint = getHint(session);
+        if (session.version != versionBefore) ctx.journalSeq = journalHint(session);
+        response.body += "\"hint\":";
+        appendJsonString(response.body, hint);
+        response.body += ",";
+    }
+    
+    response.body += "\"results\":[";
+    if (!getQueryParam(ctx.request, "moves", moves)) moves.clear();
+    size_t pos = 0;
+    for (int step = 0; pos < moves.size() && step < MAX_BATCH_MOVES; step++) {
+        size_t comma = moves.find(',', pos);
+        if (comma == string::npos) comma = moves.size();
+        string_view room(moves.data() + pos, comma - pos);
+        pos = comma + 1;
+        
+        MoveResult result = movePlayer(session, getRoomIndex(room));
+        bool success = result == MOVE_OK || result == MOVE_TREASURE;
+        if (success) ctx.journalSeq = journalMove(session);
+        if (result == MOVE_TREASURE) recordIfWon(session);
+        
+        if (step > 0) response.body += ",";
+        response.body += "{\"room\":";
+        appendJsonString(response.body, room);
+        response.body += ",\"success\":";
+        response.body += success ? "true" : "false";
+        response.body += ",\"message\":";
+        appendJsonString(response.body, moveMessage(result, room));
+        response.body += ",\"foundTreasure\":";
+        response.body += result == MOVE_TREASURE ? "true" : "false";
+        response.body += "}";
+        if (!success) break;
+    }
+    
+    response.body += "],\"state\":";
+    response.body += *getGameState(session);
+    response.body += "}";
+    return response;
+}
+
+HttpResponse hintEndpoint(RequestContext& ctx) {
+    unsigned versionBefore = ctx.session.version;
+    string hint = getHint(ctx.session);
+    if (ctx.session.version != versionBefore) ctx.journalSeq = journalHint(ctx.session);
+    HttpResponse response;
+    response.body = "{\"hint\":";
+    appendJsonString(response.body, hint);
+    response.body += ",\"used\":";
+    response.body += ctx.session.hintUsed ? "true" : "false";
+    response.body += "}";
+    return response;
+}
+
+HttpResponse resetEndpoint(RequestContext& ctx) {
+    resetGame(ctx.session);
+    ctx.journalSeq = journalReset(ctx.session);
+    HttpResponse response;
+    response.body = "{\"success\":true,\"message\":\"Game reset\"}";
+    return response;
+}
+
+HttpResponse pathEndpoint(RequestContext& ctx) {
+    static thread_local string startRoom, endRoom;
+    vector<int> path;
+    if (getQueryParam(ctx.request, "start", startRoom) && getQueryParam(ctx.request, "end", endRoom)) {
+        path = findShortestPath(getRoomIndex(startRoom), getRoomIndex(endRoom));
+    }
+    
+    HttpResponse response;
+    response.body = "{\"path\":[";
+    for (size_t i = 0; i < path.size(); i++) {
+        if (i > 0) response.body += ",";
+        appendJsonString(response.body, castle.name(path[i]));
+    }
+    response.body += "]}";
+    return response;
+}
+
+// Fewest moves to collect the remaining treasures from the current room, or
+// with ?from=start every treasure of this game from the entrance
+HttpResponse routeEndpoint(RequestContext& ctx) {
+    GameSession& session = ctx.session;
+    static thread_local string from;
+    bool fromStart = getQueryParam(ctx.request, "from", from) && from == "start";
+    int start = fromStart ? castle.entrance : session.currentRoom;
+    TourPlan plan = planTour(start, treasureRooms(session, fromStart));
+    int movesLeft = fromStart ? maxMoves : maxMoves - session.moves;
+    
+    HttpResponse response;
+    response.body = "{\"moves\":" + to_string(plan.moves);
+    response.body += ",\"movesLeft\":" + to_string(movesLeft);
+    response.body += ",\"winnable\":";
+    response.body += plan.moves >= 0 && plan.moves <= movesLeft ? "true" : "false";
+    response.body += ",\"optimal\":";
+    response.body += plan.optimal ? "true" : "false";
+    response.body += ",\"order\":[";
+    for (size_t i = 0; i < plan.order.size(); i++) {
+        if (i > 0) response.body += ",";
+        appendJsonString(response.body, castle.name(plan.order[i]));
+    }
+    response.body += "],\"path\":[";
+    vector<int> path = plan.moves >= 0 ? tourPath(start, plan) : vector<int>();
+    for (size_t i = 0; i < path.size(); i++) {
+        if (i > 0) response.body += ",";
+        appendJsonString(response.body, castle.name(path[i]));
+    }
+    response.body += "]}";
+    return response;
+}
+
+// Moves from a room (default: the current one) to the nearest treasure still
+// hidden, read from the game's distance field: ?room=Hall
+HttpResponse proximityEndpoint(RequestContext& ctx) {
+    GameSession& session = ctx.session;
+    static thread_local string room;
+    int index = getQueryParam(ctx.request, "room", room) ? getRoomIndex(room) : session.currentRoom;
+    
+    HttpResponse response;
+    if (index < 0) {
+        response.status = 404;
+        response.body = "{\"error\":\"Room not found\"}";
+        return response;
+    }
+    int distance = treasureDistance(session, index);
+    response.body = "{\"room\":";
+    appendJsonString(response.body, castle.name(index));
+    response.body += ",\"distance\":" + to_string(distance);
+    response.body += ",\"treasuresLeft\":" + to_string(session.treasureCount - session.treasuresFound());
+    response.body += "}";
+    return response;
+}
+
+// Prometheus scrape: server-wide, so it needs no session
+HttpResponse metricsResponse() {
+    size_t sessions = 0, sessionBytes = 0;
+    for (SessionShard& shard : sessionShards) {
+        lock_guard<mutex> guard(shard.lock);
+        sessions += shard.sessions.size();
+        sessionBytes += shard.pool.bytes();
+    }
+    size_t waits;
+    {
+        lock_guard<mutex> guard(waiterLock);
+        waits = pendingWaits.size();
+    }
+    
+    HttpResponse response;
+    response.contentType = "text/plain; version=0.0.4";
+    appendMetrics(response.body);
+    response.body += "# HELP treasure_sessions_active Games currently held in memory.\n";
+    response.body += "# TYPE treasure_sessions_active gauge\n";
+    response.body += "treasure_sessions_active " + to_string(sessions) + "\n";
+    response.body += "# HELP treasure_session_pool_bytes Memory reserved for sessions by the slab pools.\n";
+    response.body += "# TYPE treasure_session_pool_bytes gauge\n";
+    response.body += "treasure_session_pool_bytes " + to_string(sessionBytes) + "\n";
+    response.body += "# HELP treasure_long_polls_pending Parked /api/wait requests.\n";
+    response.body += "# TYPE treasure_long_polls_pending gauge\n";
+    response.body += "treasure_long_polls_pending " + to_string(waits) + "\n";
+    response.body += "# HELP treasure_log_lines_dropped_total Log lines dropped because the log buffer was full.\n";
+    response.body += "# TYPE treasure_log_lines_dropped_total counter\n";
+    response.body += "treasure_log_lines_dropped_total " + to_string(logLinesDropped.load()) + "\n";
+    return response;
+}
+
+struct Route {
+    string_view method;
+    string_view path;
+    Endpoint endpoint;
+    MetricHistogram metric;
+    bool changesGame;  // refused while the journal cannot save changes
+};
+
+const Route routes[] = {
+    { "GET", "/api/state", stateEndpoint, TIME_STATE, false },
+    { "GET", "/api/wait",  waitEndpoint,  TIME_WAIT,  false },
+    { "GET", "/api/move",  moveEndpoint,  TIME_MOVE,  true },
+    { "GET", "/api/hint",  hintEndpoint,  TIME_HINT,  true },
+    { "GET", "/api/reset", resetEndpoint, TIME_RESET, true },
+    { "GET", "/api/path",  pathEndpoint,  TIME_PATH,  false },
+    { "GET", "/api/route", routeEndpoint, TIME_ROUTE, false },
+    { "GET", "/api/batch", batchEndpoint, TIME_BATCH, true },
+    { "GET", "/api/proximity", proximityEndpoint, TIME_PROXIMITY, false },
+};
+
+// Frontend files, read and compressed once at startup. Each encoding keeps
+// its body and its response headers ready, so serving one is a lookup and
+// a single gather write of memory the response shares.
+const char* const WEB_CACHE_CONTROL = "Cache-Control: public, max-age=3600\r\n";
+
+struct WebAssetVariant {
+    shared_ptr<const string> body;
+    string etag;     // quoted; differs per encoding because the bytes do
+    string headers;  // ETag, Cache-Control, Vary and Content-Encoding lines
+};
+
+struct WebAsset {
+    vector<string> paths;  // request paths answered with this file
+    const char* contentType;
+    WebAssetVariant identity, gzip, brotli;  // gzip/brotli bodies are null when not smaller
+};
+
+vector<WebAsset> webAssets;
+
+shared_ptr<const string> gzipCompress(const string& data) {
+    z_stream zs{};
+    if (deflateInit2(&zs, Z_BEST_COMPRESSION, Z_DEFLATED, 15 + 16, 9, Z_DEFAULT_STRATEGY) != Z_OK) return nullptr;
+    string out(deflateBound(&zs, data.size()), '\0');
+    zs.next_in = (Bytef*)data.data();
+    zs.avail_in = (uInt)data.size();
+    zs.next_out = (Bytef*)&out[0];
+    zs.avail_out = (uInt)out.size();
+    int status = deflate(&zs, Z_FINISH);
+    out.resize(zs.total_out);
+    deflateEnd(&zs);
+    if (status != Z_STREAM_END || out.size() >= data.size()) return nullptr;
+    return make_shared<const string>(move(out));
+}
+
+shared_ptr<const string> brotliCompress(const string& data) {
+    size_t size = BrotliEncoderMaxCompressedSize(data.size());
+    if (size == 0) return nullptr;
+    string out(size, '\0');
+    if (!BrotliEncoderCompress(BROTLI_MAX_QUALITY, BROTLI_DEFAULT_WINDOW, BROTLI_MODE_TEXT, data.size(),
+                               (const uint8_t*)data.data(), &size, (uint8_t*)&out[0])
+        || size >= data.size()) {
+        return nullptr;
+    }
+    out.resize(size);
+    return make_shared<const string>(move(out));
+}
+
+void prepareVariant(WebAssetVariant& variant, shared_ptr<const string> body, const string& hash, const char* encoding) {
+    variant.body = move(body);
+    if (!variant.body) return;
+    variant.etag = "\"" + hash + (encoding ? string("-") + encoding : "") + "\"";
+    variant.headers = "ETag: " + variant.etag + "\r\n" + WEB_CACHE_CONTROL + "Vary: Accept-Encoding\r\n";
+    if (encoding) variant.headers += string("Content-Encoding: ") + encoding + "\r\n";
+}
+
+bool loadWebAsset(const string& file, vector<string> paths, const char* contentType) {
+    string data;
+    if (!readDataFile(webRoot + "/" + file, data)) return false;
+    
+    uint64_t h = 14695981039346656037ULL;  // FNV-1a
+    for (char c : data) h = (h ^ (unsigned char)c) * 1099511628211ULL;
+    char hash[17];
+    snprintf(hash, sizeof(hash), "%016llx", (unsigned long long)h);
+    
+    WebAsset asset;
+    asset.paths = move(paths);
+    asset.contentType = contentType;
+    prepareVariant(asset.gzip, gzipCompress(data), hash, "gzip");
+    prepareVariant(asset.brotli, brotliCompress(data), hash, "br");
+    prepareVariant(asset.identity, make_shared<const string>(move(data)), hash, nullptr);
+    logMessage(LOG_INFO, "Serving %s: %zu bytes, gzip %zu, br %zu", file.c_str(), asset.identity.body->size(),
+               asset.gzip.body ? asset.gzip.body->size() : 0, asset.brotli.body ? asset.brotli.body->size() : 0);
+    webAssets.push_back(move(asset));
+    return true;
+}
+
+void loadWebAssets() {
+    if (!loadWebAsset("index_n.html", { "/", "/index.html", "/index_n.html" }, "text/html; charset=utf-8")) {
+        logMessage(LOG_WARN, "No index_n.html in %s; the frontend is not served", webRoot.c_str());
+    }
+}
+
+// True if an Accept-Encoding header allows coding (not listed with q=0)
+bool acceptsEncoding(string_view header, string_view coding) {
+    while (!header.empty()) {
+        size_t comma = header.find(',');
+        string_view item = header.substr(0, comma);
+        header.remove_prefix(comma == string_view::npos ? header.size() : comma + 1);
+        
+        while (!item.empty() && item.front() == ' ') item.remove_prefix(1);
+        size_t semi = item.find(';');
+        string_view name = item.substr(0, semi);
+        while (!name.empty() && name.back() == ' ') name.remove_suffix(1);
+        if (!equalsIgnoreCase(name, coding)) continue;
+        
+        size_t q = semi == string_view::npos ? string_view::npos : item.find("q=", semi);
+        return q == string_view::npos || atof(string(item.substr(q + 2)).c_str()) > 0;
+    }
+    return false;
+}
+
+const WebAsset* findWebAsset(string_view path) {
+    for (const WebAsset& asset : webAssets)
+        for (const string& p : asset.paths)
+            if (p == path) return &asset;
+    return nullptr;
+}
+
+HttpResponse webAssetResponse(const WebAsset& asset, const HttpRequest& request) {
+    string_view accept = request.header("Accept-Encoding");
+    const WebAssetVariant* variant = &asset.identity;
+    if (asset.brotli.body && acceptsEncoding(accept, "br")) variant = &asset.brotli;
+    else if (asset.gzip.body && acceptsEncoding(accept, "gzip")) variant = &asset.gzip;
+    
+    HttpResponse response;
+    response.headers = variant->headers;
+    if (request.header("If-None-Match").find(variant->etag) != string_view::npos) {
+        response.status = 304;
+        return response;
+    }
+    response.contentType = asset.contentType;
+    response.sharedBody = variant->body;
+    return response;
+}
+
+const Route* findRoute(string_view method, string_view path) {
+    for (const Route& route : routes)
+        if (route.path == path && route.method == method) return &route;
+    return nullptr;
+}
+
+// Turns away a change while the journal cannot save one. Nothing has been
+// applied, so the client may simply try again.
+HttpResponse notSavedResponse() {
+    HttpResponse response;
+    response.status = 503;
+    response.headers = "Retry-After: 1\r\n";
+    response.body = "{\"error\":\"Games cannot be saved right now, try again shortly\"}";
+    return response;
+}
+
+HttpResponse handleRequest(const HttpRequest& request, const ReplyFn& reply) {
+    MetricTimer timer(TIME_OTHER);
+    HttpResponse response;
+    if (request.method == "OPTIONS") {
+        response.status = 204;
+        return response;
+    }
+    if (request.method == "GET" && request.path == "/metrics") return metricsResponse();
+    if (request.method == "GET" && request.path == "/api/leaderboard") {
+        // Shared by every player, so it neither needs nor creates a session
+        timer.histogram = TIME_LEADERBOARD;
+        response.sharedBody = leaderboardSnapshot();
+        return response;
+    }
+    if (request.method == "GET") {
+        if (const WebAsset* asset = findWebAsset(request.path)) {
+            timer.histogram = TIME_STATIC;
+            return webAssetResponse(*asset, request);
+        }
+    }
+    
+    const Route* route = findRoute(request.method, request.path);
+    if (!route) {
+        response.status = 404;
+        response.body = "{\"error\":\"Unknown endpoint\"}";
+        return response;
+    }
+    
+    timer.histogram = route->metric;
+    if (route->changesGame && journalFailed.load(memory_order_relaxed)) return notSavedResponse();
+    
+    // The session token comes from the query string (cross-origin GUI) or a cookie
+    string_view token;
+    if (!findParam(request.query, "session", token)) token = getCookie(request.header("Cookie"), "session");
+    
+    bool created;
+    uint64_t journalSeq;
+    GameSession* session = getOrCreateSession(token, created, journalSeq);
+    
+    lock_guard<SessionLock> guard(session->lock);
+    unsigned versionBefore = session->version;
+    RequestContext ctx = { request, *session, reply, journalSeq };
+    response = route->endpoint(ctx);
+    if (session->version != versionBefore) notifyStateWaiters(*session);
+    
+    if (created) {
+        response.headers += "Set-Cookie: session=" + string(session->tokenView()) + "; Path=/; HttpOnly; SameSite=Lax\r\n";
+    }
+    
+    // Hold the reply until the change it reports is on disk. If the write
+    // fails, the change has still happened and stays queued for the retry,
+    // so the reply goes out as it is, marked as not saved yet.
+    if (ctx.journalSeq != 0 && !response.deferred) {
+        auto held = make_shared<HttpResponse>(move(response));
+        whenDurable(ctx.journalSeq, [reply, held](bool saved) {
+            if (!saved) held->headers += "X-Game-Saved: pending\r\n";
+            reply(move(*held));
+        });
+        response = HttpResponse();
+        response.deferred = true;
+    }
+    return response;
+}
+
+// Turns a request away before it reaches a worker: 503 while the workers
+// are too far behind, 429 once the client's address or session runs out of
+// tokens. /metrics always gets through so an overload stays observable.
+bool rejectRequest(uint32_t clientIp, const HttpRequest& request, int pending, HttpResponse& rejection) {
+    if (request.path == "/metrics") return false;
+    
+    int retryAfter;
+    if (pending >= maxPendingRequests) {
+        rejection.status = 503;
+        rejection.body = "{\"error\":\"Server busy\"}";
+        retryAfter = 1;
+        countMetric(REQUESTS_SHED);
+    } else {
+        retryAfter = ipBuckets.take((uint64_t)clientIp + 1, ipRateLimit);
+        string_view token;
+        if (!findParam(request.query, "session", token)) token = getCookie(request.header("Cookie"), "session");
+        if (retryAfter == 0 && !token.empty()) retryAfter = sessionBuckets.take(hash<string_view>()(token) | 1, sessionRateLimit);
+        if (retryAfter == 0) return false;
+        rejection.status = 429;
+        rejection.body = "{\"error\":\"Too many requests\"}";
+        countMetric(REQUESTS_RATE_LIMITED);
+    }
+    rejection.headers = "Retry-After: " + to_string(retryAfter) + "\r\n";
+    return true;
+}
+
+// Request target for the access log, with the session token (the only
+// credential a game has) replaced by "-"
+string redactedTarget(string_view target) {
+    string out(target);
+    for (size_t pos = out.find('?'); pos != string::npos; pos = out.find('&', pos + 1)) {
+        if (out.compare(pos + 1, 8, "session=") != 0) continue;
+        size_t valueStart = pos + 9;
+        size_t valueEnd = out.find('&', valueStart);
+        out.replace(valueStart, (valueEnd == string::npos ? out.size() : valueEnd) - valueStart, "-");
+    }
+    return out;
+}
+
+// Encoded response waiting to be written. The three parts are sent with
+// one gather write, so the body is never copied into a header buffer.
+struct OutgoingResponse {
+    const string* headerBlock;  // prebuilt status line and constant headers
+    string headers;             // Content-Length, extra headers, Connection
+    shared_ptr<const string> body;
+    
+    size_t size() const { return headerBlock->size() + headers.size() + (body ? body->size() : 0); }
+};
+
+// Connection state for the event loop. Requests may arrive split across
+// several reads, so input is buffered until a full request is available.
+struct Connection {
+    SOCKET fd;
+    string inBuf;
+    deque<OutgoingResponse> outQueue;
+    size_t outOffset = 0;  // bytes of the front response already sent
+    size_t outBytes = 0;   // queued bytes not yet sent
+    bool closeAfterWrite = false;
+    bool wantRead = true;  // cleared while the buffers are full, so a client cannot outrun us
+    bool wantWrite = false;
+    bool busy = false;  // a request is being handled by a worker
+    size_t scanPos = 0;  // input already searched for the end of the headers
+    unsigned long long id = 0;
+    uint32_t clientIp = 0;  // IPv4 address in network order, for rate limiting
+    time_t lastActive = 0;
+};
+
+struct PollEvent {
+    SOCKET fd;
+    bool readable;
+    bool writable;
+};
+
+// Readiness notification: epoll on Linux, select() everywhere else
+struct Poller {
+#ifdef __linux__
+    int epfd = -1;
+    vector<epoll_event> events = vector<epoll_event>(1024);
+
+    bool open() {
+        epfd = epoll_create1(0);
+        return epfd != -1;
+    }
+
+    void add(SOCKET fd) {
+        epoll_event ev{};
+        ev.events = EPOLLIN;
+        ev.data.fd = fd;
+        epoll_ctl(epfd, EPOLL_CTL_ADD, fd, &ev);
+    }
+
+    void setInterest(SOCKET fd, bool wantRead, bool wantWrite) {
+        epoll_event ev{};
+        ev.events = (wantRead ? (uint32_t)EPOLLIN : 0u) | (wantWrite ? (uint32_t)EPOLLOUT : 0u);
+        ev.data.fd = fd;
+        epoll_ctl(epfd, EPOLL_CTL_MOD, fd, &ev);
+    }
+
+    void remove(SOCKET fd) {
+        epoll_ctl(epfd, EPOLL_CTL_DEL, fd, nullptr);
+    }
+
+    void wait(vector<PollEvent>& out, int timeoutMs) {
+        out.clear();
+        int n = epoll_wait(epfd, events.data(), (int)events.size(), timeoutMs);
+        for (int i = 0; i < n; i++) {
+            bool failed = events[i].events & (EPOLLERR | EPOLLHUP);
+            out.push_back({ events[i].data.fd,
+                            (events[i].events & EPOLLIN) || failed,
+                            (events[i].events & EPOLLOUT) != 0 });
+        }
+    }
+#else
+    map<SOCKET, pair<bool, bool>> watched;  // fd -> wants read, wants write
+
+    bool open() { return true; }
+    void add(SOCKET fd) { watched[fd] = { true, false }; }
+    void setInterest(SOCKET fd, bool wantRead, bool wantWrite) { watched[fd] = { wantRead, wantWrite }; }
+    void remove(SOCKET fd) { watched.erase(fd); }
+
+    void wait(vector<PollEvent>& out, int timeoutMs) {
+        out.clear();
+        fd_set readSet, writeSet;
+        FD_ZERO(&readSet);
+        FD_ZERO(&writeSet);
+        SOCKET maxFd = 0;
+        for (auto& w : watched) {
+            if (w.second.first) FD_SET(w.first, &readSet);
+            if (w.second.second) FD_SET(w.first, &writeSet);
+            if (w.first > maxFd) maxFd = w.first;
+        }
+        timeval tv;
+        tv.tv_sec = timeoutMs / 1000;
+        tv.tv_usec = (timeoutMs % 1000) * 1000;
+        if (select((int)maxFd + 1, &readSet, &writeSet, nullptr, &tv) <= 0) return;
+        for (auto& w : watched) {
+            bool r = FD_ISSET(w.first, &readSet);
+            bool wr = FD_ISSET(w.first, &writeSet);
+            if (r || wr) out.push_back({ w.first, r, wr });
+        }
+    }
+#endif
+};
+
+bool setNonBlocking(SOCKET fd) {
+#ifdef _WIN32
+    u_long mode = 1;
+    return ioctlsocket(fd, FIONBIO, &mode) == 0;
+#else
+    int flags = fcntl(fd, F_GETFL, 0);
+    return flags != -1 && fcntl(fd, F_SETFL, flags | O_NONBLOCK) == 0;
+#endif
+}
+
+bool wouldBlock() {
+#ifdef _WIN32
+    return WSAGetLastError() == WSAEWOULDBLOCK;
+#else
+    return errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR;
+#endif
+}
+
+const char* statusText(int status) {
+    switch (status) {
+        case 200: return "200 OK";
+        case 204: return "204 No Content";
+        case 304: return "304 Not Modified";
+        case 400: return "400 Bad Request";
+        case 404: return "404 Not Found";
+        case 429: return "429 Too Many Requests";
+        case 503: return "503 Service Unavailable";
+        default: return "500 Internal Server Error";
+    }
+}
+
+bool hasBody(int status) {
+    return status != 204 && status != 304;
+}
+
+// Status line and constant headers for every status we send, rendered once,
+// with and without the JSON content type
+const string& headerBlock(int status, bool json = true) {
+    static const int statuses[] = { 200, 204, 304, 400, 404, 429, 500, 503 };
+    static const vector<string> blocks = [] {
+        vector<string> rendered;
+        for (bool withJson : { true, false }) {
+            for (int status : statuses) {
+                string block = string("HTTP/1.1 ") + statusText(status) + "\r\n";
+                if (withJson && hasBody(status)) block += "Content-Type: application/json\r\n";
+                block += "Access-Control-Allow-Origin: *\r\n";
+                block += "Access-Control-Allow-Methods: GET, POST, OPTIONS\r\n";
+                block += "Access-Control-Allow-Headers: Content-Type\r\n";
+                if (status == 204) block += "Access-Control-Max-Age: 86400\r\n";
+                rendered.push_back(block);
+            }
+        }
+        return rendered;
+    }();
+    
+    const size_t count = sizeof(statuses) / sizeof(statuses[0]);
+    size_t base = json ? 0 : count;
+    for (size_t i = 0; i < count; i++)
+        if (statuses[i] == status) return blocks[base + i];
+    return blocks[base + count - 1];
+}
+
+OutgoingResponse encodeResponse(HttpResponse&& response, bool keepAlive) {
+    OutgoingResponse out;
+    out.headerBlock = &headerBlock(response.status, !response.contentType);
+    if (response.contentType) out.headers = string("Content-Type: ") + response.contentType + "\r\n";
+    if (hasBody(response.status)) {
+        out.body = response.sharedBody ? move(response.sharedBody)
+                                       : make_shared<const string>(move(response.body));
+        out.headers += "Content-Length: " + to_string(out.body->size()) + "\r\n";
+    }
+    out.headers += response.headers;
+    out.headers += keepAlive ? "Connection: keep-alive\r\n\r\n" : "Connection: close\r\n\r\n";
+    return out;
+}
+
+#ifdef _WIN32
+typedef WSABUF IoSlice;
+
+void setSlice(IoSlice& slice, const char* data, size_t size) {
+    slice.buf = (char*)data;
+    slice.len = (ULONG)size;
+}
+
+long sendSlices(SOCKET fd, IoSlice* slices, int count) {
+    DWORD sent = 0;
+    if (WSASend(fd, slices, count, &sent, 0, nullptr, nullptr) == SOCKET_ERROR) return -1;
+    return (long)sent;
+}
+#else
+typedef iovec IoSlice;
+
+void setSlice(IoSlice& slice, const char* data, size_t size) {
+    slice.iov_base = (void*)data;
+    slice.iov_len = size;
+}
+
+long sendSlices(SOCKET fd, IoSlice* slices, int count) {
+    msghdr msg{};
+    msg.msg_iov = slices;
+    msg.msg_iovlen = count;
+    return (long)sendmsg(fd, &msg, MSG_NOSIGNAL);
+}
+#endif
+
+void queueResponse(Connection& conn, OutgoingResponse&& out) {
+    conn.outBytes += out.size();
+    conn.outQueue.push_back(move(out));
+}
+
+// Writes as much pending output as the socket accepts, gathering several
+// queued responses per call. Returns false on error.
+bool flushOutput(Connection& conn) {
+    const int MAX_SLICES = 48;
+    IoSlice slices[MAX_SLICES];
+    
+    while (!conn.outQueue.empty()) {
+        int count = 0;
+        size_t skip = conn.outOffset;
+        for (size_t r = 0; r < conn.outQueue.size() && count + 3 <= MAX_SLICES; r++) {
+            const OutgoingResponse& out = conn.outQueue[r];
+            const string* parts[3] = { out.headerBlock, &out.headers, out.body.get() };
+            for (const string* part : parts) {
+                if (!part || part->empty()) continue;
+                if (skip >= part->size()) {
+                    skip -= part->size();
+                    continue;
+                }
+                setSlice(slices[count++], part->data() + skip, part->size() - skip);
+                skip = 0;
+            }
+        }
+        
+        long sent = sendSlices(conn.fd, slices, count);
+        if (sent < 0) return wouldBlock();
+        countMetric(BYTES_SENT, sent);
+        conn.outBytes -= sent;
+        
+        // Retire fully written responses; a partial one stays at the front
+        size_t done = conn.outOffset + sent;
+        while (!conn.outQueue.empty() && done >= conn.outQueue.front().size()) {
+            done -= conn.outQueue.front().size();
+            conn.outQueue.pop_front();
+        }
+        conn.outOffset = done;
+    }
+    return true;
+}
+
+// Fixed set of worker threads that run request handlers. Each worker owns a
+// queue; idle workers steal from the back of the others' queues so a slow
+// request does not hold up the jobs queued behind it.
+class WorkerPool {
+public:
+    void start(int threadCount) {
+        for (int i = 0; i < threadCount; i++) queues.emplace_back(new JobQueue);
+        for (int i = 0; i < threadCount; i++) threads.emplace_back(&WorkerPool::run, this, i);
+    }
+    
+    void submit(function<void()> job) {
+        JobQueue& q = *queues[nextQueue];
+        nextQueue = (nextQueue + 1) % queues.size();
+        {
+            lock_guard<mutex> guard(q.lock);
+            q.jobs.push_back(move(job));
+        }
+        {
+            lock_guard<mutex> guard(sleepLock);
+            pending++;
+        }
+        wake.notify_one();
+    }
+    
+private:
+    struct JobQueue {
+        mutex lock;
+        deque<function<void()>> jobs;
+    };
+    
+    bool takeJob(int self, function<void()>& job) {
+        int count = (int)queues.size();
+        for (int i = 0; i < count; i++) {
+            JobQueue& q = *queues[(self + i) % count];
+            lock_guard<mutex> guard(q.lock);
+            if (q.jobs.empty()) continue;
+            if (i == 0) {
+                job = move(q.jobs.front());
+                q.jobs.pop_front();
+            } else {
+                job = move(q.jobs.back());
+                q.jobs.pop_back();
+            }
+            return true;
+        }
+        return false;
+    }
+    
+    void run(int self) {
+        while (true) {
+            {
+                unique_lock<mutex> guard(sleepLock);
+                wake.wait(guard, [this] { return pending > 0; });
+                pending--;
+            }
+            function<void()> job;
+            while (!takeJob(self, job)) this_thread::yield();
+            job();
+        }
+    }
+    
+    vector<unique_ptr<JobQueue>> queues;
+    vector<thread> threads;
+    size_t nextQueue = 0;
+    mutex sleepLock;
+    condition_variable wake;
+    int pending = 0;
+};
+
+// A request handed to a worker: its raw bytes and the parsed views into them
+struct RequestJob {
+    string raw;
+    HttpRequest request;
+};
+
+void rebaseView(string_view& view, const char* from, const char* to) {
+    if (view.data()) view = string_view(to + (view.data() - from), view.size());
+}
+
+void rebaseRequest(HttpRequest& req, const char* from, const char* to) {
+    for (string_view* view : { &req.method, &req.target, &req.path, &req.query, &req.version, &req.body })
+        rebaseView(*view, from, to);
+    for (int i = 0; i < req.headerCount; i++) {
+        rebaseView(req.headerNames[i], from, to);
+        rebaseView(req.headerValues[i], from, to);
+    }
+}
+
+// A finished response handed back from a worker to the event loop
+struct Completion {
+    SOCKET fd;
+    unsigned long long connId;
+    OutgoingResponse response;
+    bool keepAlive;
+};
+
+class EventLoop {
+public:
+    bool open(SOCKET listener, int threadCount) {
+        serverSocket = listener;
+        if (!poller.open()) return false;
+        poller.add(serverSocket);
+#ifdef __linux__
+        wakeFd = eventfd(0, EFD_NONBLOCK);
+        if (wakeFd == -1) return false;
+        poller.add(wakeFd);
+#endif
+        workers.start(threadCount);
+        return true;
+    }
+    
+    void run() {
+        vector<PollEvent> events;
+        time_t lastSweep = time(0);
+        
+        while (true) {
+            // Without an eventfd to wake on, poll briefly while workers are busy
+            int timeout = 1000;
+#ifndef __linux__
+            if (inFlight > 0) timeout = 10;
+#endif
+            poller.wait(events, timeout);
+            
+            for (const PollEvent& ev : events) {
+                if (ev.fd == serverSocket) {
+                    acceptClients();
+                } else if (ev.fd == wakeFd) {
+#ifdef __linux__
+                    uint64_t count;
+                    while (read(wakeFd, &count, sizeof(count)) > 0) {}
+#endif
+                } else {
+                    onSocketEvent(ev);
+                }
+            }
+            drainCompletions();
+            
+            // Drop keep-alive connections that have gone quiet
+            time_t now = time(0);
+            if (now != lastSweep) {
+                lastSweep = now;
+                sweepIdleSessions(now);
+                expireStateWaiters(now);
+                vector<SOCKET> idle;
+                for (auto& c : connections)
+                    if (!c.second.busy && now - c.second.lastActive > KEEP_ALIVE_TIMEOUT) idle.push_back(c.first);
+                for (SOCKET fd : idle) closeConnection(fd);
+            }
+        }
+    }
+    
+private:
+    void acceptClients() {
+        while (true) {
+            sockaddr_in clientAddr;
+            socklen_t clientLen = sizeof(clientAddr);
+            SOCKET clientSocket = accept(serverSocket, (sockaddr*)&clientAddr, &clientLen);
+            if (clientSocket == INVALID_SOCKET) return;
+            
+            if (!setNonBlocking(clientSocket)) {
+                closesocket(clientSocket);
+                continue;
+            }
+            int noDelay = 1;
+            setsockopt(clientSocket, IPPROTO_TCP, TCP_NODELAY, (char*)&noDelay, sizeof(noDelay));
+            
+            Connection& conn = connections[clientSocket];
+            conn.fd = clientSocket;
+            conn.id = ++lastConnId;
+            conn.clientIp = clientAddr.sin_addr.s_addr;
+            conn.lastActive = time(0);
+            poller.add(clientSocket);
+            countMetric(CONNECTIONS_ACCEPTED);
+        }
+    }
+    
+    void onSocketEvent(const PollEvent& ev) {
+        auto it = connections.find(ev.fd);
+        if (it == connections.end()) return;
+        Connection& conn = it->second;
+        bool ok = true;
+        
+        // Read interest is off while paused, so only an error or hangup gets here
+        if (ev.readable && !conn.wantRead) ok = false;
+        
+        if (ok && ev.readable) {
+            char buffer[4096];
+            while (ok && conn.inBuf.size() < MAX_REQUEST_SIZE) {
+                int received = recv(conn.fd, buffer, sizeof(buffer), 0);
+                if (received > 0) {
+                    conn.inBuf.append(buffer, received);
+                    countMetric(BYTES_RECEIVED, received);
+                } else {
+                    ok = received == SOCKET_ERROR && wouldBlock();
+                    break;
+                }
+            }
+            conn.lastActive = time(0);
+            if (ok) ok = dispatchNext(conn);
+        }
+        
+        finishIo(conn, ok);
+    }
+    
+    // Hands the next complete request in the input buffer to the workers,
+    // answering any turned away by admission control on the spot. Only one
+    // request per connection is in flight so replies stay in order, and none
+    // while the client is not reading its replies.
+    // Returns false if the connection should be dropped without a reply.
+    bool dispatchNext(Connection& conn) {
+        while (true) {
+            if (conn.busy || conn.closeAfterWrite || conn.outBytes >= MAX_QUEUED_OUTPUT) return true;
+            
+            // Stray line breaks between requests are allowed and ignored
+            size_t leading = 0;
+            while (leading < conn.inBuf.size() && (conn.inBuf[leading] == '\r' || conn.inBuf[leading] == '\n')) leading++;
+            if (leading > 0) {
+                conn.inBuf.erase(0, leading);
+                conn.scanPos = 0;
+            }
+            
+            // Resume the search where the last read left off
+            size_t headEnd = conn.inBuf.find("\r\n\r\n", conn.scanPos > 3 ? conn.scanPos - 3 : 0);
+            if (headEnd == string::npos) {
+                conn.scanPos = conn.inBuf.size();
+                return conn.inBuf.size() < MAX_REQUEST_SIZE;  // a full buffer can no longer hold a valid request
+            }
+            
+            auto job = make_shared<RequestJob>();
+            HttpRequest& req = job->request;
+            size_t bodyLength = 0;
+            string_view contentLength;
+            if (!parseHttpHead(string_view(conn.inBuf.data(), headEnd), req)
+                || (!(contentLength = req.header("Content-Length")).empty() && !parseDecimal(contentLength, bodyLength))) {
+                HttpResponse badRequest;
+                badRequest.status = 400;
+                badRequest.body = "{\"error\":\"Bad request\"}";
+                queueResponse(conn, encodeResponse(move(badRequest), false));
+                conn.closeAfterWrite = true;
+                return true;
+            }
+            size_t requestSize = headEnd + 4 + bodyLength;
+            if (requestSize > MAX_REQUEST_SIZE) return false;
+            if (conn.inBuf.size() < requestSize) {
+                conn.scanPos = 0;
+                return true;
+            }
+            req.body = string_view(conn.inBuf.data() + headEnd + 4, bodyLength);
+            
+            // Hand the bytes over to the job, moving the whole buffer when it holds
+            // just this request, and point the parsed views at their new home
+            const char* oldBase = conn.inBuf.data();
+            if (conn.inBuf.size() == requestSize) {
+                job->raw = move(conn.inBuf);
+                conn.inBuf.clear();
+            } else {
+                job->raw.assign(conn.inBuf, 0, requestSize);
+                conn.inBuf.erase(0, requestSize);
+            }
+            conn.scanPos = 0;
+            rebaseRequest(req, oldBase, job->raw.data());
+            
+            if (sampleAccessLog()) {
+                string target = redactedTarget(req.target);
+                logMessage(LOG_INFO, "%.*s %s", (int)req.method.size(), req.method.data(), target.c_str());
+            }
+            
+            bool keepAlive = req.keepAlive();
+            HttpResponse rejection;
+            if (rejectRequest(conn.clientIp, req, pendingRequests.load(memory_order_relaxed), rejection)) {
+                queueResponse(conn, encodeResponse(move(rejection), keepAlive));
+                if (!keepAlive) {
+                    conn.closeAfterWrite = true;
+                    return true;
+                }
+                continue;
+            }
+            
+            conn.busy = true;
+            inFlight++;
+            pendingRequests++;
+            SOCKET fd = conn.fd;
+            unsigned long long connId = conn.id;
+            workers.submit([this, fd, connId, keepAlive, job] {
+                ReplyFn reply = [this, fd, connId, keepAlive](HttpResponse response) {
+                    complete({ fd, connId, encodeResponse(move(response), keepAlive), keepAlive });
+                };
+                HttpResponse response = handleRequest(job->request, reply);
+                pendingRequests--;
+                if (!response.deferred) reply(move(response));
+            });
+            return true;
+        }
+    }
+    
+    // Called from worker threads
+    void complete(Completion&& done) {
+        {
+            lock_guard<mutex> guard(completionLock);
+            completions.push_back(move(done));
+        }
+#ifdef __linux__
+        uint64_t one = 1;
+        if (write(wakeFd, &one, sizeof(one)) < 0) {}
+#endif
+    }
+    
+    void drainCompletions() {
+        vector<Completion> ready;
+        {
+            lock_guard<mutex> guard(completionLock);
+            ready.swap(completions);
+        }
+        for (Completion& done : ready) {
+            inFlight--;
+            auto it = connections.find(done.fd);
+            if (it == connections.end() || it->second.id != done.connId) continue;
+            
+            Connection& conn = it->second;
+            conn.busy = false;
+            queueResponse(conn, move(done.response));
+            if (!done.keepAlive) conn.closeAfterWrite = true;
+            finishIo(conn, dispatchNext(conn));
+        }
+    }
+    
+    // Flushes pending output, then closes the connection or updates its
+    // read and write interest
+    void finishIo(Connection& conn, bool ok) {
+        // Requests held back by a full output queue go ahead as it drains
+        while (ok && !conn.outQueue.empty()) {
+            ok = flushOutput(conn);
+            size_t buffered = conn.inBuf.size();
+            if (ok) ok = dispatchNext(conn);
+            if (conn.inBuf.size() == buffered) break;
+        }
+        
+        if (!ok || (conn.closeAfterWrite && conn.outQueue.empty() && !conn.busy)) {
+            closeConnection(conn.fd);
+            return;
+        }
+        // Stop reading while the input buffer is full or replies pile up, so
+        // the kernel pushes back on the client; only ask for writability
+        // while a reply is stuck in the queue
+        bool wantRead = !conn.closeAfterWrite && conn.inBuf.size() < MAX_REQUEST_SIZE
+                        && conn.outBytes < MAX_QUEUED_OUTPUT;
+        bool wantWrite = !conn.outQueue.empty();
+        if (wantRead != conn.wantRead || wantWrite != conn.wantWrite) {
+            conn.wantRead = wantRead;
+            conn.wantWrite = wantWrite;
+            poller.setInterest(conn.fd, wantRead, wantWrite);
+        }
+    }
+    
+    void closeConnection(SOCKET fd) {
+        poller.remove(fd);
+        closesocket(fd);
+        connections.erase(fd);
+        countMetric(CONNECTIONS_CLOSED);
+    }
+    
+    SOCKET serverSocket = INVALID_SOCKET;
+    SOCKET wakeFd = INVALID_SOCKET;
+    Poller poller;
+    WorkerPool workers;
+    map<SOCKET, Connection> connections;
+    unsigned long long lastConnId = 0;
+    int inFlight = 0;
+    atomic<int> pendingRequests{0};  // submitted to the workers and not yet handled
+    mutex completionLock;
+    vector<Completion> completions;
+};
+
+int main(int argc, char* argv[]) {
+    cout << "=== C++ Treasure Hunt Server ===" << endl;
+    cout << "==================================" << endl;
+    
+    for (int i = 1; i < argc; i++) {
+        string arg = argv[i];
+        if (arg == "--backlog" && i + 1 < argc) {
+            listenBacklog = atoi(argv[++i]);
+        } else if (arg == "--threads" && i + 1 < argc) {
+            workerThreads = max(1, atoi(argv[++i]));
+        } else if (arg == "--log-level" && i + 1 < argc) {
+            LogLevel level;
+            if (!parseLogLevel(argv[++i], level)) {
+                cerr << "Unknown log level: " << argv[i] << endl;
+                return 1;
+            }
+            logLevel = level;
+        } else if (arg == "--access-log-sample" && i + 1 < argc) {
+            accessLogSample = (unsigned)max(0, atoi(argv[++i]));
+        } else if (arg == "--slack" && i + 1 < argc) {
+            placementSlack = max(0, atoi(argv[++i]));
+        } else if (arg == "--treasures" && i + 1 < argc) {
+            treasureCount = min(max(1, atoi(argv[++i])), MAX_TREASURES);
+        } else if (arg == "--map" && i + 1 < argc) {
+            mapFile = argv[++i];
+        } else if (arg == "--proximity-mb" && i + 1 < argc) {
+            proximityFieldBytes = (size_t)max(0, atoi(argv[++i])) << 20;
+        } else if (arg == "--route-cache-mb" && i + 1 < argc) {
+            routeCacheBytes = (size_t)max(1, atoi(argv[++i])) << 20;
+        } else if (arg == "--data-dir" && i + 1 < argc) {
+            dataDir = argv[++i];
+        } else if (arg == "--snapshot-interval" && i + 1 < argc) {
+            snapshotInterval = max(1, atoi(argv[++i]));
+        } else if (arg == "--web-root" && i + 1 < argc) {
+            webRoot = argv[++i];
+        } else if ((arg == "--ip-rate" || arg == "--session-rate") && i + 1 < argc) {
+            if (!parseRateLimit(argv[++i], arg == "--ip-rate" ? ipRateLimit : sessionRateLimit)) {
+                cerr << "Bad rate limit: " << argv[i] << endl;
+                return 1;
+            }
+        } else if (arg == "--max-pending" && i + 1 < argc) {
+            maxPendingRequests = max(1, atoi(argv[++i]));
+        } else if (arg == "--compile-map" && i + 2 < argc) {
+            string error;
+            if (!compileCastleFile(argv[i + 1], argv[i + 2], error)) {
+                cerr << "Cannot compile map: " << error << endl;
+                return 1;
+            }
+            cout << "Compiled " << argv[i + 1] << " to " << argv[i + 2] << endl;
+            return 0;
+        } else {
+            cerr << "Usage: " << argv[0] << " [--backlog N] [--threads N] [--map FILE] [--route-cache-mb N] [--proximity-mb N] [--treasures N] [--slack N]"
+                 << " [--data-dir DIR] [--snapshot-interval SECONDS] [--web-root DIR]"
+                 << " [--ip-rate N[/BURST]] [--session-rate N[/BURST]] [--max-pending N]"
+                 << " [--log-level debug|info|warn|error|off] [--access-log-sample N]" << endl;
+            cerr << "       " << argv[0] << " --compile-map MAP.txt MAP.bin" << endl;
+            return 1;
+        }
+    }
+    
+    #ifdef _WIN32
+    WSADATA wsaData;
+    if (WSAStartup(MAKEWORD(2, 2), &wsaData) != 0) {
+        cerr << "WSAStartup failed" << endl;
+        return 1;
+    }
+    #else
+    signal(SIGPIPE, SIG_IGN);
+    #endif
+    
+    if (!initializeGame() || !restoreGames()) return 1;
+    loadWebAssets();
+    
+    SOCKET serverSocket = socket(AF_INET, SOCK_STREAM, 0);
+    if (serverSocket == INVALID_SOCKET) {
+        cerr << "Socket creation failed" << endl;
+        return 1;
+    }
+    
+    int opt = 1;
+    setsockopt(serverSocket, SOL_SOCKET, SO_REUSEADDR, (char*)&opt, sizeof(opt));
+    
+    sockaddr_in serverAddr;
+    serverAddr.sin_family = AF_INET;
+    serverAddr.sin_addr.s_addr = INADDR_ANY;
+    serverAddr.sin_port = htons(PORT);
+    
+    if (bind(serverSocket, (sockaddr*)&serverAddr, sizeof(serverAddr)) == SOCKET_ERROR) {
+        cerr << "Bind failed" << endl;
+        closesocket(serverSocket);
+        return 1;
+    }
+    
+    if (listen(serverSocket, listenBacklog) == SOCKET_ERROR || !setNonBlocking(serverSocket)) {
+        cerr << "Listen failed" << endl;
+        closesocket(serverSocket);
+        return 1;
+    }
+    
+    cout << "\n?? Server running on http://localhost:" << PORT << endl;
+    if (webAssets.empty()) cout << "?? Open index_n.html in your browser to play!" << endl;
+    else cout << "?? Open http://localhost:" << PORT << "/ in your browser to play!" << endl;
+    cout << "?? Press Ctrl+C to stop server\n" << endl;
+    cout << "Waiting for connections...\n" << endl;
+    
+    EventLoop loop;
+    if (!loop.open(serverSocket, workerThreads)) {
+        cerr << "Event loop setup failed" << endl;
+        closesocket(serverSocket);
+        return 1;
+    }
+    loop.run();
+    
+    closesocket(serverSocket);
+    
+    #ifdef _WIN32
+    WSACleanup();
+    #endif
+    
+    return 0;
+}
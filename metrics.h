@@ -0,0 +1,208 @@
+// Low-overhead server metrics: counters and latency histograms kept per
+// thread and summed when /metrics is scraped, in Prometheus text format.
+//
+// Each thread only ever writes its own block, so updates are plain relaxed
+// loads and stores with no locked instructions or shared cache lines.
+
+#ifndef METRICS_H
+#define METRICS_H
+
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+
+enum MetricCounter {
+    BYTES_RECEIVED,
+    BYTES_SENT,
+    CONNECTIONS_ACCEPTED,
+    CONNECTIONS_CLOSED,
+    REQUESTS_RATE_LIMITED,
+    REQUESTS_SHED,
+    RATE_LIMIT_EVICTIONS,
+    PROXIMITY_SEARCHES,
+    COUNTER_COUNT
+};
+
+// Timed operations. The HTTP endpoints come first and share one metric name.
+enum MetricHistogram {
+    TIME_STATE,
+    TIME_WAIT,
+    TIME_MOVE,
+    TIME_HINT,
+    TIME_RESET,
+    TIME_PATH,
+    TIME_ROUTE,
+    TIME_BATCH,
+    TIME_PROXIMITY,
+    TIME_STATIC,
+    TIME_LEADERBOARD,
+    TIME_OTHER,  // OPTIONS, /metrics and unknown paths
+    TIME_ROUTE_BFS,
+    TIME_STATE_SERIALIZE,
+    TIME_JOURNAL_COMMIT,
+    TIME_DISTANCE_FIELD,
+    HISTOGRAM_COUNT
+};
+
+const int ENDPOINT_HISTOGRAMS = TIME_OTHER + 1;
+const char* const endpointNames[ENDPOINT_HISTOGRAMS] = { "state", "wait", "move", "hint", "reset",
+                                                         "path", "route", "batch", "proximity", "static",
+                                                         "leaderboard", "other" };
+
+// Upper bucket bounds in microseconds; a final +Inf bucket follows
+const uint32_t histogramBounds[] = { 10, 25, 50, 100, 250, 500, 1000, 2500, 5000, 10000, 25000,
+                                     50000, 100000, 250000, 500000, 1000000, 2500000 };
+const int HISTOGRAM_BUCKETS = sizeof(histogramBounds) / sizeof(histogramBounds[0]) + 1;
+
+struct ThreadMetrics {
+    struct Histogram {
+        std::atomic<uint64_t> buckets[HISTOGRAM_BUCKETS] = {};
+        std::atomic<uint64_t> count{0};
+        std::atomic<uint64_t> sumNanos{0};
+    };
+
+    std::atomic<uint64_t> counters[COUNTER_COUNT] = {};
+    Histogram histograms[HISTOGRAM_COUNT];
+};
+
+inline std::mutex metricsLock;
+inline std::vector<std::unique_ptr<ThreadMetrics>> allThreadMetrics;  // never shrinks
+
+inline ThreadMetrics& threadMetrics() {
+    thread_local ThreadMetrics* mine = [] {
+        std::lock_guard<std::mutex> guard(metricsLock);
+        allThreadMetrics.emplace_back(new ThreadMetrics);
+        return allThreadMetrics.back().get();
+    }();
+    return *mine;
+}
+
+// Single-writer increment: no read-modify-write needed
+inline void bump(std::atomic<uint64_t>& value, uint64_t by) {
+    value.store(value.load(std::memory_order_relaxed) + by, std::memory_order_relaxed);
+}
+
+inline void countMetric(MetricCounter counter, uint64_t by = 1) {
+    bump(threadMetrics().counters[counter], by);
+}
+
+inline void observeNanos(MetricHistogram histogram, uint64_t nanos) {
+    ThreadMetrics::Histogram& h = threadMetrics().histograms[histogram];
+    uint64_t micros = nanos / 1000;
+    int bucket = 0;
+    while (bucket < HISTOGRAM_BUCKETS - 1 && micros > histogramBounds[bucket]) bucket++;
+    bump(h.buckets[bucket], 1);
+    bump(h.count, 1);
+    bump(h.sumNanos, nanos);
+}
+
+// Records the lifetime of the timer into a histogram, which may be chosen
+// after the timer starts
+struct MetricTimer {
+    MetricHistogram histogram;
+    std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+
+    explicit MetricTimer(MetricHistogram h) : histogram(h) {}
+    ~MetricTimer() {
+        auto elapsed = std::chrono::steady_clock::now() - start;
+        observeNanos(histogram, std::chrono::duration_cast<std::chrono::nanoseconds>(elapsed).count());
+    }
+};
+
+inline uint64_t sumCounter(MetricCounter counter) {
+    std::lock_guard<std::mutex> guard(metricsLock);
+    uint64_t total = 0;
+    for (auto& m : allThreadMetrics) total += m->counters[counter].load(std::memory_order_relaxed);
+    return total;
+}
+
+inline void appendHistogram(std::string& out, const std::string& name, const std::string& labels, MetricHistogram histogram) {
+    uint64_t buckets[HISTOGRAM_BUCKETS] = {};
+    uint64_t count = 0, sumNanos = 0;
+    {
+        std::lock_guard<std::mutex> guard(metricsLock);
+        for (auto& m : allThreadMetrics) {
+            ThreadMetrics::Histogram& h = m->histograms[histogram];
+            for (int b = 0; b < HISTOGRAM_BUCKETS; b++) buckets[b] += h.buckets[b].load(std::memory_order_relaxed);
+            count += h.count.load(std::memory_order_relaxed);
+            sumNanos += h.sumNanos.load(std::memory_order_relaxed);
+        }
+    }
+
+    std::string prefix = labels.empty() ? "{" : "{" + labels + ",";
+    uint64_t cumulative = 0;
+    for (int b = 0; b < HISTOGRAM_BUCKETS; b++) {
+        cumulative += buckets[b];
+        std::string le = b < HISTOGRAM_BUCKETS - 1 ? std::to_string(histogramBounds[b] / 1e6) : "+Inf";
+        out += name + "_bucket" + prefix + "le=\"" + le + "\"} " + std::to_string(cumulative) + "\n";
+    }
+    std::string suffix = labels.empty() ? "" : "{" + labels + "}";
+    out += name + "_sum" + suffix + " " + std::to_string(sumNanos / 1e9) + "\n";
+    out += name + "_count" + suffix + " " + std::to_string(count) + "\n";
+}
+
+// Counters and histograms in Prometheus text format. Gauges owned by the
+// server (sessions, connections) are appended by the caller.
+inline void appendMetrics(std::string& out) {
+    out += "# HELP treasure_http_requests_total HTTP requests handled, by endpoint.\n";
+    out += "# TYPE treasure_http_requests_total counter\n";
+    for (int e = 0; e < ENDPOINT_HISTOGRAMS; e++) {
+        uint64_t count = 0;
+        {
+            std::lock_guard<std::mutex> guard(metricsLock);
+            for (auto& m : allThreadMetrics) count += m->histograms[e].count.load(std::memory_order_relaxed);
+        }
+        out += std::string("treasure_http_requests_total{endpoint=\"") + endpointNames[e] + "\"} "
+             + std::to_string(count) + "\n";
+    }
+
+    out += "# HELP treasure_http_request_duration_seconds Time spent handling a request, by endpoint.\n";
+    out += "# TYPE treasure_http_request_duration_seconds histogram\n";
+    for (int e = 0; e < ENDPOINT_HISTOGRAMS; e++) {
+        appendHistogram(out, "treasure_http_request_duration_seconds",
+                        std::string("endpoint=\"") + endpointNames[e] + "\"", (MetricHistogram)e);
+    }
+
+    out += "# HELP treasure_route_bfs_duration_seconds Time spent building a shortest-path table.\n";
+    out += "# TYPE treasure_route_bfs_duration_seconds histogram\n";
+    appendHistogram(out, "treasure_route_bfs_duration_seconds", "", TIME_ROUTE_BFS);
+    out += "# HELP treasure_state_serialize_duration_seconds Time spent rebuilding a state document.\n";
+    out += "# TYPE treasure_state_serialize_duration_seconds histogram\n";
+    appendHistogram(out, "treasure_state_serialize_duration_seconds", "", TIME_STATE_SERIALIZE);
+    out += "# HELP treasure_journal_commit_duration_seconds Time spent writing and syncing one journal batch.\n";
+    out += "# TYPE treasure_journal_commit_duration_seconds histogram\n";
+    appendHistogram(out, "treasure_journal_commit_duration_seconds", "", TIME_JOURNAL_COMMIT);
+    out += "# HELP treasure_distance_field_duration_seconds Time spent building or updating a treasure distance field.\n";
+    out += "# TYPE treasure_distance_field_duration_seconds histogram\n";
+    appendHistogram(out, "treasure_distance_field_duration_seconds", "", TIME_DISTANCE_FIELD);
+
+    out += "# HELP treasure_bytes_received_total Bytes read from client connections.\n";
+    out += "# TYPE treasure_bytes_received_total counter\n";
+    out += "treasure_bytes_received_total " + std::to_string(sumCounter(BYTES_RECEIVED)) + "\n";
+    out += "# HELP treasure_bytes_sent_total Bytes written to client connections.\n";
+    out += "# TYPE treasure_bytes_sent_total counter\n";
+    out += "treasure_bytes_sent_total " + std::to_string(sumCounter(BYTES_SENT)) + "\n";
+    out += "# HELP treasure_requests_rejected_total Requests turned away before a handler ran, by reason.\n";
+    out += "# TYPE treasure_requests_rejected_total counter\n";
+    out += "treasure_requests_rejected_total{reason=\"rate_limit\"} " + std::to_string(sumCounter(REQUESTS_RATE_LIMITED)) + "\n";
+    out += "treasure_requests_rejected_total{reason=\"overload\"} " + std::to_string(sumCounter(REQUESTS_SHED)) + "\n";
+    out += "# HELP treasure_rate_limit_evictions_total Rate limit buckets evicted to make room for a new client.\n";
+    out += "# TYPE treasure_rate_limit_evictions_total counter\n";
+    out += "treasure_rate_limit_evictions_total " + std::to_string(sumCounter(RATE_LIMIT_EVICTIONS)) + "\n";
+    out += "# HELP treasure_proximity_searches_total Proximity queries answered by a search because the game had no distance field.\n";
+    out += "# TYPE treasure_proximity_searches_total counter\n";
+    out += "treasure_proximity_searches_total " + std::to_string(sumCounter(PROXIMITY_SEARCHES)) + "\n";
+    out += "# HELP treasure_connections_accepted_total Client connections accepted.\n";
+    out += "# TYPE treasure_connections_accepted_total counter\n";
+    out += "treasure_connections_accepted_total " + std::to_string(sumCounter(CONNECTIONS_ACCEPTED)) + "\n";
+    out += "# HELP treasure_connections_active Client connections currently open.\n";
+    out += "# TYPE treasure_connections_active gauge\n";
+    uint64_t closed = sumCounter(CONNECTIONS_CLOSED);  // read first so the difference never goes negative
+    out += "treasure_connections_active " + std::to_string(sumCounter(CONNECTIONS_ACCEPTED) - closed) + "\n";
+}
+
+#endif
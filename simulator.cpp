@@ -0,0 +1,316 @@
+// Headless game simulator: plays seeded games with bot strategies on every
+// core to tune the move budget and treasure count for a map.
+//
+//   g++ -std=c++17 -O2 -pthread simulator.cpp -o treasure_sim
+//   ./treasure_sim [--map FILE] [--games N] [--threads N] [--seed S]
+//                  [--strategies random,greedy,hint-first] [--max-moves 6,8,10]
+//                  [--treasures 2,3] [--slack N]
+//
+// Every combination of strategy, move budget and treasure count plays the
+// same games: game i's layout and the bot's choices come from a seed mixed
+// from (seed, i), so the results do not depend on the thread count. Each
+// thread plays its own slice with its own session, PRNG and counters, which
+// are summed once the threads finish.
+
+#include "game.h"
+
+#include <chrono>
+#include <iomanip>
+#include <thread>
+
+using namespace std;
+using Clock = chrono::steady_clock;
+
+// What a bot knows beyond the current room, plus scratch space for its
+// searches so a move allocates nothing
+struct Bot {
+    GameRng rng{0};
+    int goal = -1;  // room the bot is heading for, -1 if wandering
+    uint32_t stamp = 0;
+    vector<uint32_t> seen;  // seen[r] == stamp once r is queued in the current search
+    vector<int> parent;
+    vector<int> queue;
+};
+
+// First step on a shortest path to goal, or to the nearest hidden treasure
+// when goal is -1. The search stops at the moves left in the game, so on a
+// big map it only ever touches the rooms the bot could still reach.
+int stepToward(const GameSession& session, Bot& bot, int goal) {
+    if (bot.seen.size() != (size_t)castle.roomCount) {
+        bot.seen.assign(castle.roomCount, 0);
+        bot.parent.assign(castle.roomCount, -1);
+        bot.queue.resize(castle.roomCount);
+        bot.stamp = 0;
+    }
+    if (++bot.stamp == 0) {
+        fill(bot.seen.begin(), bot.seen.end(), 0);
+        bot.stamp = 1;
+    }
+
+    int start = session.currentRoom;
+    int head = 0, tail = 0, levelEnd = 1, depth = 0;
+    int movesLeft = maxMoves - session.moves;
+    bot.queue[tail++] = start;
+    bot.seen[start] = bot.stamp;
+
+    while (head < tail) {
+        if (head == levelEnd) {
+            if (++depth > movesLeft) break;
+            levelEnd = tail;
+        }
+        int current = bot.queue[head++];
+        if (current != start && (goal >= 0 ? current == goal : session.treasureAt(current) >= 0)) {
+            while (bot.parent[current] != start) current = bot.parent[current];
+            return current;
+        }
+        for (const int* n = castle.begin(current); n != castle.end(current); n++) {
+            if (bot.seen[*n] != bot.stamp) {
+                bot.seen[*n] = bot.stamp;
+                bot.parent[*n] = current;
+                bot.queue[tail++] = *n;
+            }
+        }
+    }
+    return -1;
+}
+
+int randomNeighbor(const GameSession& session, Bot& bot) {
+    int degree = castle.degree(session.currentRoom);
+    if (degree == 0) return -1;
+    return castle.begin(session.currentRoom)[bot.rng.below((uint32_t)degree)];
+}
+
+// Wanders without any knowledge of the treasures
+int randomStrategy(GameSession& session, Bot& bot) {
+    return randomNeighbor(session, bot);
+}
+
+// Knows every treasure and heads for the nearest one still hidden
+int greedyStrategy(GameSession& session, Bot& bot) {
+    int next = stepToward(session, bot, -1);
+    return next >= 0 ? next : randomNeighbor(session, bot);
+}
+
+// Spends the hint first, walks to the treasure it points at, then wanders
+int hintFirstStrategy(GameSession& session, Bot& bot) {
+    if (!session.hintUsed) {
+        getHint(session);
+        for (int i = 0; i < session.treasureCount && bot.goal < 0; i++)
+            if (!((session.collected >> i) & 1)) bot.goal = session.treasures[i];
+    }
+    if (bot.goal == session.currentRoom) bot.goal = -1;
+    if (bot.goal < 0) return randomNeighbor(session, bot);
+
+    int next = stepToward(session, bot, bot.goal);
+    return next >= 0 ? next : randomNeighbor(session, bot);
+}
+
+struct Strategy {
+    const char* name;
+    int (*chooseMove)(GameSession& session, Bot& bot);
+};
+
+const Strategy strategies[] = {
+    { "random", randomStrategy },
+    { "greedy", greedyStrategy },
+    { "hint-first", hintFirstStrategy },
+};
+
+struct SimStats {
+    uint64_t games = 0;
+    uint64_t wins = 0;
+    uint64_t treasuresFound = 0;
+    uint64_t unwinnable = 0;     // layouts placement could not fit in the budget
+    vector<uint64_t> winMoves;   // won games by moves taken
+
+    void add(const SimStats& other) {
+        games += other.games;
+        wins += other.wins;
+        treasuresFound += other.treasuresFound;
+        unwinnable += other.unwinnable;
+        if (winMoves.size() < other.winMoves.size()) winMoves.resize(other.winMoves.size());
+        for (size_t m = 0; m < other.winMoves.size(); m++) winMoves[m] += other.winMoves[m];
+    }
+};
+
+// splitmix64 finaliser over (seed, game), so game i is the same on any thread
+uint64_t gameSeed(uint64_t seed, uint64_t game) {
+    GameRng mix(seed ^ (game * 0xd1b54a32d192ed03ULL));
+    return mix.next();
+}
+
+void playGames(const Strategy& strategy, uint64_t seed, uint64_t first, uint64_t last, SimStats& out) {
+    SimStats stats;
+    stats.winMoves.assign(maxMoves + 1, 0);
+    GameSession session;
+    Bot bot;
+
+    for (uint64_t g = first; g < last; g++) {
+        bot.rng = GameRng(gameSeed(seed, g));
+        bot.goal = -1;
+        resetGame(session, bot.rng.next());
+
+        while (session.treasuresFound() < session.treasureCount && session.moves < maxMoves) {
+            MoveResult result = movePlayer(session, strategy.chooseMove(session, bot));
+            if (result != MOVE_OK && result != MOVE_TREASURE) break;
+        }
+
+        int found = session.treasuresFound();
+        stats.games++;
+        stats.treasuresFound += found;
+        if (session.bestMoves < 0) stats.unwinnable++;
+        if (found == session.treasureCount) {
+            stats.wins++;
+            stats.winMoves[session.moves]++;
+        }
+    }
+    out = move(stats);
+}
+
+// Moves taken by the p-th won game
+int movePercentile(const SimStats& stats, double p) {
+    uint64_t rank = (uint64_t)(p * (stats.wins - 1) + 0.5), seen = 0;
+    for (size_t m = 0; m < stats.winMoves.size(); m++) {
+        seen += stats.winMoves[m];
+        if (seen > rank) return (int)m;
+    }
+    return (int)stats.winMoves.size() - 1;
+}
+
+void printStats(const string& strategy, const SimStats& stats, double seconds) {
+    cout << "  " << left << setw(12) << strategy << right << fixed
+         << setprecision(1) << setw(8) << 100.0 * stats.wins / stats.games << "%"
+         << setprecision(2) << setw(9) << (double)stats.treasuresFound / stats.games;
+    if (stats.wins > 0) cout << setw(6) << movePercentile(stats, 0.5) << setw(6) << movePercentile(stats, 0.9);
+    else cout << setw(6) << "-" << setw(6) << "-";
+    cout << setprecision(0) << setw(12) << stats.games / seconds << "  ";
+
+    // Share of wins at each move count, one digit per count (tenths, '+' for all)
+    for (int m = 1; m < (int)stats.winMoves.size(); m++) {
+        if (stats.wins == 0 || stats.winMoves[m] == 0) { cout << '.'; continue; }
+        int tenths = (int)(10 * stats.winMoves[m] / stats.wins);
+        cout << (tenths >= 10 ? '+' : (char)('0' + tenths));
+    }
+    cout << endl;
+}
+
+vector<int> parseList(const string& list, int minimum) {
+    vector<int> values;
+    size_t pos = 0;
+    while (pos < list.size()) {
+        size_t comma = list.find(',', pos);
+        if (comma == string::npos) comma = list.size();
+        int n = atoi(list.substr(pos, comma - pos).c_str());
+        if (n >= minimum) values.push_back(n);
+        pos = comma + 1;
+    }
+    return values;
+}
+
+int main(int argc, char* argv[]) {
+    string mapPath;
+    uint64_t games = 1000000;
+    int threads = max(1u, thread::hardware_concurrency());
+    uint64_t seed = 1;
+    vector<int> budgets = { maxMoves };
+    vector<int> counts = { treasureCount };
+    vector<const Strategy*> chosen;
+    string strategyList = "random,greedy,hint-first";
+
+    for (int i = 1; i < argc; i++) {
+        string arg = argv[i];
+        if (arg == "--map" && i + 1 < argc) {
+            mapPath = argv[++i];
+        } else if (arg == "--games" && i + 1 < argc) {
+            games = max(1ULL, strtoull(argv[++i], nullptr, 10));
+        } else if (arg == "--threads" && i + 1 < argc) {
+            threads = max(1, atoi(argv[++i]));
+        } else if (arg == "--seed" && i + 1 < argc) {
+            seed = strtoull(argv[++i], nullptr, 10);
+        } else if (arg == "--strategies" && i + 1 < argc) {
+            strategyList = argv[++i];
+        } else if (arg == "--max-moves" && i + 1 < argc) {
+            budgets = parseList(argv[++i], 1);
+        } else if (arg == "--treasures" && i + 1 < argc) {
+            counts = parseList(argv[++i], 1);
+        } else if (arg == "--slack" && i + 1 < argc) {
+            placementSlack = max(0, atoi(argv[++i]));
+        } else {
+            cerr << "Usage: " << argv[0] << " [--map FILE] [--games N] [--threads N] [--seed S]" << endl;
+            cerr << "       [--strategies random,greedy,hint-first] [--max-moves N,N,...] [--treasures N,N,...] [--slack N]" << endl;
+            return 1;
+        }
+    }
+
+    size_t pos = 0;
+    while (pos < strategyList.size()) {
+        size_t comma = strategyList.find(',', pos);
+        if (comma == string::npos) comma = strategyList.size();
+        string name = strategyList.substr(pos, comma - pos);
+        const Strategy* found = nullptr;
+        for (const Strategy& s : strategies)
+            if (name == s.name) found = &s;
+        if (!found) {
+            cerr << "Unknown strategy: " << name << endl;
+            return 1;
+        }
+        chosen.push_back(found);
+        pos = comma + 1;
+    }
+    if (budgets.empty() || counts.empty() || chosen.empty()) {
+        cerr << "Nothing to simulate" << endl;
+        return 1;
+    }
+    for (int count : counts) {
+        if (count > MAX_TREASURES) {
+            cerr << "At most " << MAX_TREASURES << " treasures per game" << endl;
+            return 1;
+        }
+    }
+
+    string error;
+    if (!loadGameMap(mapPath, error)) {
+        cerr << "Cannot load castle map: " << error << endl;
+        return 1;
+    }
+    if (castle.roomCount <= *max_element(counts.begin(), counts.end())) {
+        cerr << "The castle needs more rooms than treasures" << endl;
+        return 1;
+    }
+    logLevel = LOG_ERROR;  // unwinnable layouts are counted below instead of logged per game
+
+    cout << "Simulating " << games << " games per configuration on " << castle.roomCount << " rooms, "
+         << threads << " threads, seed " << seed << endl;
+
+    for (int count : counts) {
+        for (int budget : budgets) {
+            treasureCount = count;
+            maxMoves = budget;
+            cout << "\n" << count << " treasures, " << budget << " moves, slack " << placementSlack << endl;
+            cout << "  " << left << setw(12) << "strategy" << right << setw(9) << "win"
+                 << setw(9) << "found" << setw(6) << "p50" << setw(6) << "p90"
+                 << setw(12) << "games/s" << "  wins by moves 1.." << budget << endl;
+
+            uint64_t unwinnable = 0;
+            for (const Strategy* strategy : chosen) {
+                vector<SimStats> perThread(threads);
+                vector<thread> workers;
+                auto start = Clock::now();
+                for (int t = 0; t < threads; t++) {
+                    uint64_t first = games * t / threads, last = games * (t + 1) / threads;
+                    workers.emplace_back(playGames, cref(*strategy), seed, first, last, ref(perThread[t]));
+                }
+                for (thread& w : workers) w.join();
+                double seconds = chrono::duration<double>(Clock::now() - start).count();
+
+                SimStats total;
+                for (const SimStats& s : perThread) total.add(s);
+                printStats(strategy->name, total, seconds);
+                unwinnable = total.unwinnable;
+            }
+            if (unwinnable > 0)
+                cout << "  " << unwinnable << " layouts did not fit in the budget" << endl;
+        }
+    }
+    return 0;
+}